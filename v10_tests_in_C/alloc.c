@@ -0,0 +1,104 @@
+// This file contains a bump-pointer arena allocator.
+//
+// The compiler creates a large number of small objects (tokens, AST
+// nodes, types, scopes) and never frees any of them individually.
+// Allocating each of them with its own calloc() call wastes time in
+// malloc bookkeeping and scatters the objects all over the heap, so
+// instead we carve them out of big chunks, one arena per compiler
+// phase. An arena can be reset as a whole, which makes every object
+// allocated from it invalid at once but keeps its chunks around for
+// reuse.
+
+#include "chibicc.h"
+
+// Default size of a chunk. A request larger than this gets a chunk
+// of its own.
+#define CHUNK_SIZE (1 << 20)
+
+// Every allocation is aligned to this boundary, which is enough for
+// any object the compiler allocates from an arena.
+#define ARENA_ALIGN 8
+
+struct ArenaChunk {
+  ArenaChunk *next;
+  size_t size;  // Usable bytes in `data`
+  _Alignas(ARENA_ALIGN) char data[];
+};
+
+Arena token_arena = {"token"};
+Arena node_arena = {"ast"};
+Arena type_arena = {"type"};
+Arena scope_arena = {"scope"};
+
+Arena *arenas[] = {&token_arena, &node_arena, &type_arena, &scope_arena, NULL};
+
+static ArenaChunk *new_chunk(Arena *arena, size_t size) {
+  if (size < CHUNK_SIZE)
+    size = CHUNK_SIZE;
+
+  ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + size);
+  if (!chunk)
+    error("out of memory");
+  chunk->next = NULL;
+  chunk->size = size;
+
+  arena->nr_chunks++;
+  arena->reserved += size;
+  return chunk;
+}
+
+// Makes a chunk with at least `size` free bytes the current one.
+// Chunks left over from before the last reset are reused if they
+// are big enough.
+static void next_chunk(Arena *arena, size_t size) {
+  ArenaChunk *prev = arena->cur;
+  ArenaChunk *chunk = prev ? prev->next : arena->head;
+
+  if (!chunk || chunk->size < size) {
+    ArenaChunk *fresh = new_chunk(arena, size);
+    fresh->next = chunk;
+    if (prev)
+      prev->next = fresh;
+    else
+      arena->head = fresh;
+    chunk = fresh;
+  }
+
+  arena->cur = chunk;
+  arena->ptr = chunk->data;
+  arena->end = chunk->data + chunk->size;
+}
+
+// Returns `size` bytes of zero-initialized memory.
+void *arena_alloc(Arena *arena, size_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+  if ((size_t)(arena->end - arena->ptr) < size)
+    next_chunk(arena, size);
+
+  void *p = arena->ptr;
+  arena->ptr += size;
+  arena->nr_allocs++;
+  arena->used += size;
+  return memset(p, 0, size);
+}
+
+char *arena_strndup(Arena *arena, char *p, size_t len) {
+  char *buf = arena_alloc(arena, len + 1);
+  memcpy(buf, p, len);
+  return buf;
+}
+
+// Releases every object in a given arena at once. The chunks are
+// kept so that the next round of allocations doesn't need malloc.
+void arena_reset(Arena *arena) {
+  arena->cur = NULL;
+  arena->ptr = arena->end = NULL;
+  arena->nr_allocs = 0;
+  arena->used = 0;
+}
+
+void arena_reset_all(void) {
+  for (int i = 0; arenas[i]; i++)
+    arena_reset(arenas[i]);
+}
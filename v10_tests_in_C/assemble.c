@@ -0,0 +1,885 @@
+// This file contains an assembler for the x86-64 code that codegen.c
+// emits, and a writer for ELF64 relocatable object files. With -c the
+// generated assembly is encoded here and written out as an object
+// file, so that building a program doesn't need a separate assembler
+// process.
+//
+// Only the instruction forms and directives that codegen.c actually
+// uses are supported. Anything else is an internal error rather than
+// a user error, because it means codegen.c and this file have gone
+// out of sync.
+
+#include "chibicc.h"
+#include <elf.h>
+
+typedef enum {
+  SEC_UNDEF,
+  SEC_TEXT,
+  SEC_DATA,
+} Section;
+
+// Growable byte buffer holding the contents of a section
+typedef struct {
+  char *data;
+  size_t len;
+  size_t capacity;
+} Bytes;
+
+typedef struct Symbol Symbol;
+struct Symbol {
+  Symbol *next;    // Next symbol in order of first appearance
+  char *name;
+  int len;
+  uint32_t hash;
+  Section section; // SEC_UNDEF if not defined in this file
+  uint64_t offset; // Offset in `section`
+  bool is_global;
+  int index;       // Index in .symtab
+};
+
+// A reference from .text to a symbol. References to labels local to
+// this file are resolved by the assembler itself; the others become
+// relocations for the linker.
+typedef struct {
+  uint64_t offset;
+  Symbol *sym;
+  int type;
+  int64_t addend;
+} Fixup;
+
+typedef enum {
+  OP_REG,  // %rax
+  OP_IMM,  // $1
+  OP_MEM,  // 8(%rbp)
+  OP_RIP,  // foo(%rip)
+  OP_SYM,  // foo
+} OperandKind;
+
+typedef struct {
+  OperandKind kind;
+  int reg;  // Register number, or base register for OP_MEM
+  int size; // Register size in bytes
+  int64_t val;
+  Symbol *sym;
+} Operand;
+
+static Bytes text;
+static Bytes data;
+static Section cur_section;
+
+// Hash table of all symbols, and the same symbols as a list in
+// order of first appearance
+static Symbol **syms;
+static int syms_capacity;
+static int syms_used;
+static Symbol sym_head;
+static Symbol *sym_last = &sym_head;
+
+static Fixup *fixups;
+static int nr_fixups;
+static int fixups_capacity;
+
+static void reserve_bytes(Bytes *b, size_t n) {
+  if (b->capacity - b->len >= n)
+    return;
+
+  size_t capacity = b->capacity ? b->capacity * 2 : 4096;
+  while (capacity - b->len < n)
+    capacity *= 2;
+  b->data = realloc(b->data, capacity);
+  if (!b->data)
+    error("out of memory");
+  b->capacity = capacity;
+}
+
+static void put(Bytes *b, void *p, size_t n) {
+  reserve_bytes(b, n);
+  memcpy(b->data + b->len, p, n);
+  b->len += n;
+}
+
+static void put8(Bytes *b, int v) {
+  reserve_bytes(b, 1);
+  b->data[b->len++] = v;
+}
+
+static void put32(Bytes *b, int32_t v) {
+  put(b, &v, 4);
+}
+
+static Bytes *section_bytes(void) {
+  switch (cur_section) {
+  case SEC_TEXT:
+    return &text;
+  case SEC_DATA:
+    return &data;
+  case SEC_UNDEF:
+    break;
+  }
+  unreachable();
+}
+
+//
+// Symbol table
+//
+
+// FNV-1a hash
+static uint32_t hash_name(char *p, int len) {
+  uint32_t hash = 2166136261;
+  for (int i = 0; i < len; i++)
+    hash = (hash ^ (unsigned char)p[i]) * 16777619;
+  return hash;
+}
+
+static void rehash_syms(void) {
+  Symbol **old = syms;
+  int old_capacity = syms_capacity;
+
+  syms_capacity = old_capacity ? old_capacity * 2 : 256;
+  syms = calloc(syms_capacity, sizeof(Symbol *));
+
+  for (int i = 0; i < old_capacity; i++) {
+    if (!old[i])
+      continue;
+    int j = old[i]->hash & (syms_capacity - 1);
+    while (syms[j])
+      j = (j + 1) & (syms_capacity - 1);
+    syms[j] = old[i];
+  }
+  free(old);
+}
+
+// Returns the symbol with a given name, creating an undefined one if
+// it hasn't been seen yet.
+static Symbol *get_symbol(char *name, int len) {
+  if (syms_used * 2 >= syms_capacity)
+    rehash_syms();
+
+  uint32_t hash = hash_name(name, len);
+  int i = hash & (syms_capacity - 1);
+
+  for (; syms[i]; i = (i + 1) & (syms_capacity - 1)) {
+    Symbol *sym = syms[i];
+    if (sym->hash == hash && sym->len == len && !memcmp(sym->name, name, len))
+      return sym;
+  }
+
+  Symbol *sym = calloc(1, sizeof(Symbol));
+  sym->name = name;
+  sym->len = len;
+  sym->hash = hash;
+  syms[i] = sym;
+  syms_used++;
+  sym_last = sym_last->next = sym;
+  return sym;
+}
+
+//
+// Parser for one line of assembly
+//
+
+static char *names64[] = {
+  "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+  "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+};
+
+static char *names8[] = {
+  "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+  "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b",
+};
+
+static bool is_name_char(char c) {
+  return isalnum(c) || c == '_' || c == '.';
+}
+
+static char *skip_name(char *p) {
+  while (is_name_char(*p))
+    p++;
+  return p;
+}
+
+static int64_t read_int(char **rest, char *p) {
+  bool neg = (*p == '-');
+  if (neg)
+    p++;
+  if (!isdigit(*p))
+    error("internal error: number expected: %.10s", p);
+
+  int64_t val = 0;
+  while (isdigit(*p))
+    val = val * 10 + (*p++ - '0');
+  *rest = p;
+  return neg ? -val : val;
+}
+
+static void read_reg(char **rest, char *p, Operand *op) {
+  if (*p++ != '%')
+    error("internal error: register expected: %.10s", p - 1);
+
+  char *end = skip_name(p);
+  int len = end - p;
+
+  for (int i = 0; i < 16; i++) {
+    if (strlen(names64[i]) == len && !memcmp(p, names64[i], len)) {
+      *op = (Operand){OP_REG, .reg = i, .size = 8};
+      *rest = end;
+      return;
+    }
+    if (strlen(names8[i]) == len && !memcmp(p, names8[i], len)) {
+      *op = (Operand){OP_REG, .reg = i, .size = 1};
+      *rest = end;
+      return;
+    }
+  }
+  error("internal error: unknown register: %.*s", len, p);
+}
+
+// Reads `%reg`, `$imm`, `disp(%reg)`, `(%reg)`, `sym(%rip)` or `sym`.
+static void read_operand(char **rest, char *p, Operand *op) {
+  if (*p == '%') {
+    read_reg(rest, p, op);
+    return;
+  }
+
+  if (*p == '$') {
+    *op = (Operand){OP_IMM, .val = read_int(rest, p + 1)};
+    return;
+  }
+
+  if (*p == '-' || isdigit(*p) || *p == '(') {
+    int64_t disp = (*p == '(') ? 0 : read_int(&p, p);
+    if (*p++ != '(')
+      error("internal error: '(' expected: %.10s", p - 1);
+    read_reg(&p, p, op);
+    if (*p++ != ')')
+      error("internal error: ')' expected: %.10s", p - 1);
+    op->kind = OP_MEM;
+    op->val = disp;
+    *rest = p;
+    return;
+  }
+
+  char *end = skip_name(p);
+  if (end == p)
+    error("internal error: operand expected: %.10s", p);
+
+  *op = (Operand){OP_SYM, .sym = get_symbol(p, end - p)};
+  p = end;
+
+  if (!strncmp(p, "(%rip)", 6)) {
+    op->kind = OP_RIP;
+    p += 6;
+  }
+  *rest = p;
+}
+
+//
+// Instruction encoder
+//
+
+// Emits a REX prefix if one is needed. `w` selects a 64-bit operand
+// size; `r` and `b` are the registers in the ModRM reg and rm fields.
+// `force` emits an empty REX prefix anyway (see rex8()).
+static void rex(bool w, int r, int b, bool force) {
+  int v = 0x40 | (w << 3) | ((r >> 3) << 2) | (b >> 3);
+  if (v != 0x40 || force)
+    put8(&text, v);
+}
+
+// Byte registers 4 to 7 mean %spl..%dil only with a REX prefix and
+// %ah..%bh without one.
+static bool rex8(Operand *op) {
+  return op->size == 1 && op->reg >= 4;
+}
+
+static void modrm_reg(int reg, int rm) {
+  put8(&text, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// ModRM (and SIB) for a `disp(%base)` operand, using the shortest
+// displacement that fits.
+static void modrm_mem(int reg, int base, int64_t disp) {
+  int mod;
+  if (disp == 0 && (base & 7) != 5)
+    mod = 0;
+  else if (disp == (int8_t)disp)
+    mod = 1;
+  else
+    mod = 2;
+
+  put8(&text, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == 4)
+    put8(&text, 0x24);
+
+  if (mod == 1)
+    put8(&text, disp);
+  else if (mod == 2)
+    put32(&text, disp);
+}
+
+static void add_fixup(Symbol *sym, int type, int64_t addend) {
+  if (nr_fixups == fixups_capacity) {
+    fixups_capacity = fixups_capacity ? fixups_capacity * 2 : 256;
+    fixups = realloc(fixups, fixups_capacity * sizeof(Fixup));
+  }
+
+  fixups[nr_fixups++] = (Fixup){text.len, sym, type, addend};
+  put32(&text, 0);
+}
+
+static bool is_reg(Operand *op, int size) {
+  return op->kind == OP_REG && op->size == size;
+}
+
+static void bad_operands(char *insn, int len) {
+  error("internal error: unsupported operands: %.*s", len, insn);
+}
+
+// The two-operand arithmetic instructions, in AT&T order `op src, dst`.
+static bool alu(int opcode, int ext, Operand *src, Operand *dst) {
+  if (!is_reg(dst, 8))
+    return false;
+
+  if (is_reg(src, 8)) {
+    rex(true, src->reg, dst->reg, false);
+    put8(&text, opcode);
+    modrm_reg(src->reg, dst->reg);
+    return true;
+  }
+
+  if (src->kind == OP_IMM) {
+    rex(true, 0, dst->reg, false);
+    if (src->val == (int8_t)src->val) {
+      put8(&text, 0x83);
+      modrm_reg(ext, dst->reg);
+      put8(&text, src->val);
+    } else {
+      put8(&text, 0x81);
+      modrm_reg(ext, dst->reg);
+      put32(&text, src->val);
+    }
+    return true;
+  }
+  return false;
+}
+
+static bool encode_mov(Operand *src, Operand *dst) {
+  // mov $imm, %reg
+  if (src->kind == OP_IMM && is_reg(dst, 8)) {
+    rex(true, 0, dst->reg, false);
+    put8(&text, 0xc7);
+    modrm_reg(0, dst->reg);
+    put32(&text, src->val);
+    return true;
+  }
+
+  // mov %reg, %reg
+  if (is_reg(src, 8) && is_reg(dst, 8)) {
+    rex(true, src->reg, dst->reg, false);
+    put8(&text, 0x89);
+    modrm_reg(src->reg, dst->reg);
+    return true;
+  }
+
+  // mov %reg, disp(%base)
+  if (src->kind == OP_REG && dst->kind == OP_MEM) {
+    rex(src->size == 8, src->reg, dst->reg, rex8(src));
+    put8(&text, src->size == 8 ? 0x89 : 0x88);
+    modrm_mem(src->reg, dst->reg, dst->val);
+    return true;
+  }
+
+  // mov disp(%base), %reg
+  if (src->kind == OP_MEM && is_reg(dst, 8)) {
+    rex(true, dst->reg, src->reg, false);
+    put8(&text, 0x8b);
+    modrm_mem(dst->reg, src->reg, src->val);
+    return true;
+  }
+  return false;
+}
+
+static bool encode_lea(Operand *src, Operand *dst) {
+  if (!is_reg(dst, 8))
+    return false;
+
+  if (src->kind == OP_MEM) {
+    rex(true, dst->reg, src->reg, false);
+    put8(&text, 0x8d);
+    modrm_mem(dst->reg, src->reg, src->val);
+    return true;
+  }
+
+  if (src->kind == OP_RIP) {
+    rex(true, dst->reg, 0, false);
+    put8(&text, 0x8d);
+    put8(&text, ((dst->reg & 7) << 3) | 5);
+    add_fixup(src->sym, R_X86_64_PC32, -4);
+    return true;
+  }
+  return false;
+}
+
+typedef enum {
+  I_PUSH, I_POP, I_MOV, I_MOVSBQ, I_MOVZB, I_LEA,
+  I_ADD, I_SUB, I_CMP, I_IMUL, I_IDIV, I_NEG, I_CQO,
+  I_SETE, I_SETNE, I_SETL, I_SETLE,
+  I_JMP, I_JE, I_CALL, I_RET,
+} Mnemonic;
+
+static struct {
+  char *name;
+  Mnemonic id;
+} mnemonics[] = {
+  {"push", I_PUSH}, {"pop", I_POP}, {"mov", I_MOV}, {"movsbq", I_MOVSBQ},
+  {"movzb", I_MOVZB}, {"lea", I_LEA}, {"add", I_ADD}, {"sub", I_SUB},
+  {"cmp", I_CMP}, {"imul", I_IMUL}, {"idiv", I_IDIV}, {"neg", I_NEG},
+  {"cqo", I_CQO}, {"sete", I_SETE}, {"setne", I_SETNE}, {"setl", I_SETL},
+  {"setle", I_SETLE}, {"jmp", I_JMP}, {"je", I_JE}, {"call", I_CALL},
+  {"ret", I_RET},
+};
+
+static void encode(char *insn, char *end) {
+  char *p = insn;
+  while (isalpha(*p))
+    p++;
+  int len = p - insn;
+
+  int id = -1;
+  for (int i = 0; i < sizeof(mnemonics) / sizeof(*mnemonics); i++) {
+    if (strlen(mnemonics[i].name) == len && !memcmp(insn, mnemonics[i].name, len)) {
+      id = mnemonics[i].id;
+      break;
+    }
+  }
+  if (id == -1)
+    error("internal error: unknown instruction: %.*s", (int)(end - insn), insn);
+
+  Operand ops[2];
+  int nops = 0;
+  while (*p == ' ')
+    p++;
+  while (p < end) {
+    if (nops == 2)
+      bad_operands(insn, end - insn);
+    read_operand(&p, p, &ops[nops++]);
+    if (*p == ',')
+      p++;
+    while (*p == ' ')
+      p++;
+  }
+
+  Operand *a = &ops[0];
+  Operand *b = &ops[1];
+  bool ok = false;
+
+  switch (id) {
+  case I_PUSH:
+  case I_POP:
+    if (nops == 1 && is_reg(a, 8)) {
+      rex(false, 0, a->reg, false);
+      put8(&text, (id == I_PUSH ? 0x50 : 0x58) + (a->reg & 7));
+      ok = true;
+    }
+    break;
+  case I_MOV:
+    ok = nops == 2 && encode_mov(a, b);
+    break;
+  case I_MOVSBQ:
+    if (nops == 2 && a->kind == OP_MEM && is_reg(b, 8)) {
+      rex(true, b->reg, a->reg, false);
+      put(&text, "\x0f\xbe", 2);
+      modrm_mem(b->reg, a->reg, a->val);
+      ok = true;
+    }
+    break;
+  case I_MOVZB:
+    if (nops == 2 && is_reg(a, 1) && is_reg(b, 8)) {
+      rex(true, b->reg, a->reg, rex8(a));
+      put(&text, "\x0f\xb6", 2);
+      modrm_reg(b->reg, a->reg);
+      ok = true;
+    }
+    break;
+  case I_LEA:
+    ok = nops == 2 && encode_lea(a, b);
+    break;
+  case I_ADD:
+    ok = nops == 2 && alu(0x01, 0, a, b);
+    break;
+  case I_SUB:
+    ok = nops == 2 && alu(0x29, 5, a, b);
+    break;
+  case I_CMP:
+    ok = nops == 2 && alu(0x39, 7, a, b);
+    break;
+  case I_IMUL:
+    if (nops == 2 && is_reg(a, 8) && is_reg(b, 8)) {
+      rex(true, b->reg, a->reg, false);
+      put(&text, "\x0f\xaf", 2);
+      modrm_reg(b->reg, a->reg);
+      ok = true;
+    }
+    break;
+  case I_IDIV:
+  case I_NEG:
+    if (nops == 1 && is_reg(a, 8)) {
+      rex(true, 0, a->reg, false);
+      put8(&text, 0xf7);
+      modrm_reg(id == I_IDIV ? 7 : 3, a->reg);
+      ok = true;
+    }
+    break;
+  case I_CQO:
+    put(&text, "\x48\x99", 2);
+    ok = nops == 0;
+    break;
+  case I_SETE:
+  case I_SETNE:
+  case I_SETL:
+  case I_SETLE:
+    if (nops == 1 && is_reg(a, 1)) {
+      static unsigned char cc[] = {[I_SETE] = 0x94, [I_SETNE] = 0x95,
+                          [I_SETL] = 0x9c, [I_SETLE] = 0x9e};
+      rex(false, 0, a->reg, rex8(a));
+      put8(&text, 0x0f);
+      put8(&text, cc[id]);
+      modrm_reg(0, a->reg);
+      ok = true;
+    }
+    break;
+  case I_JMP:
+  case I_JE:
+  case I_CALL:
+    if (nops == 1 && a->kind == OP_SYM) {
+      if (id == I_JMP)
+        put8(&text, 0xe9);
+      else if (id == I_JE)
+        put(&text, "\x0f\x84", 2);
+      else
+        put8(&text, 0xe8);
+      add_fixup(a->sym, id == I_CALL ? R_X86_64_PLT32 : R_X86_64_PC32, -4);
+      ok = true;
+    }
+    break;
+  case I_RET:
+    put8(&text, 0xc3);
+    ok = nops == 0;
+    break;
+  }
+
+  if (!ok)
+    bad_operands(insn, end - insn);
+}
+
+static void directive(char *p, char *end) {
+  char *q = skip_name(p + 1);
+  int len = q - p;
+  while (*q == ' ')
+    q++;
+
+  if (len == 5 && !memcmp(p, ".data", 5)) {
+    cur_section = SEC_DATA;
+  } else if (len == 5 && !memcmp(p, ".text", 5)) {
+    cur_section = SEC_TEXT;
+  } else if (len == 6 && !memcmp(p, ".globl", 6)) {
+    get_symbol(q, skip_name(q) - q)->is_global = true;
+  } else if (len == 5 && !memcmp(p, ".byte", 5)) {
+    put8(section_bytes(), read_int(&q, q));
+  } else if (len == 5 && !memcmp(p, ".zero", 5)) {
+    Bytes *b = section_bytes();
+    int64_t n = read_int(&q, q);
+    reserve_bytes(b, n);
+    memset(b->data + b->len, 0, n);
+    b->len += n;
+  } else {
+    error("internal error: unknown directive: %.*s", (int)(end - p), p);
+  }
+}
+
+static void assemble_line(char *p, char *end) {
+  while (*p == ' ')
+    p++;
+  if (p == end)
+    return;
+
+  // Label
+  if (end[-1] == ':') {
+    Symbol *sym = get_symbol(p, end - 1 - p);
+    if (sym->section != SEC_UNDEF)
+      error("internal error: symbol defined twice: %.*s", sym->len, sym->name);
+    sym->section = cur_section;
+    sym->offset = section_bytes()->len;
+    return;
+  }
+
+  if (*p == '.')
+    directive(p, end);
+  else
+    encode(p, end);
+}
+
+// Resolves references to labels local to .text. The remaining
+// fixups are left in place to become relocations.
+static void resolve_fixups(void) {
+  int j = 0;
+  for (int i = 0; i < nr_fixups; i++) {
+    Fixup *f = &fixups[i];
+    Symbol *sym = f->sym;
+
+    if (sym->section == SEC_TEXT && !sym->is_global) {
+      int32_t rel = sym->offset + f->addend - f->offset;
+      memcpy(text.data + f->offset, &rel, 4);
+      continue;
+    }
+    fixups[j++] = *f;
+  }
+  nr_fixups = j;
+}
+
+//
+// ELF writer
+//
+
+enum {
+  SHN_TEXT = 1,
+  SHN_DATA,
+  SHN_RELA_TEXT,
+  SHN_SYMTAB,
+  SHN_STRTAB,
+  SHN_SHSTRTAB,
+  SHN_NOTE_STACK,
+  NR_SECTIONS,
+};
+
+// Indices of the section symbols in .symtab
+enum {
+  SYM_TEXT = 1,
+  SYM_DATA,
+};
+
+static void align_bytes(Bytes *b, int align) {
+  while (b->len % align)
+    put8(b, 0);
+}
+
+static uint32_t add_string(Bytes *strtab, char *name, int len) {
+  uint32_t off = strtab->len;
+  put(strtab, name, len);
+  put8(strtab, 0);
+  return off;
+}
+
+static bool is_local_label(Symbol *sym) {
+  return !sym->is_global && sym->len >= 2 && !memcmp(sym->name, ".L", 2);
+}
+
+static void add_symbol(Bytes *symtab, Bytes *strtab, Symbol *sym) {
+  static int shndx[] = {[SEC_UNDEF] = SHN_UNDEF, [SEC_TEXT] = SHN_TEXT,
+                        [SEC_DATA] = SHN_DATA};
+  int type = STT_NOTYPE;
+  if (sym->section == SEC_TEXT)
+    type = STT_FUNC;
+  else if (sym->section == SEC_DATA)
+    type = STT_OBJECT;
+
+  Elf64_Sym esym = {
+    .st_name = add_string(strtab, sym->name, sym->len),
+    .st_info = ELF64_ST_INFO(sym->is_global ? STB_GLOBAL : STB_LOCAL, type),
+    .st_shndx = shndx[sym->section],
+    .st_value = sym->offset,
+  };
+  sym->index = symtab->len / sizeof(Elf64_Sym);
+  put(symtab, &esym, sizeof(esym));
+}
+
+static void write_object(FILE *out) {
+  Bytes strtab = {0};
+  Bytes symtab = {0};
+  put8(&strtab, 0);
+
+  // The null symbol and the section symbols come first, then the
+  // other local symbols, then the global ones.
+  Elf64_Sym null_sym = {0};
+  put(&symtab, &null_sym, sizeof(null_sym));
+  for (int shndx = SHN_TEXT; shndx <= SHN_DATA; shndx++) {
+    assert(symtab.len / sizeof(Elf64_Sym) == shndx);
+    Elf64_Sym esym = {
+      .st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION),
+      .st_shndx = shndx,
+    };
+    put(&symtab, &esym, sizeof(esym));
+  }
+
+  for (Symbol *sym = sym_head.next; sym; sym = sym->next)
+    if (!sym->is_global && sym->section != SEC_UNDEF && !is_local_label(sym))
+      add_symbol(&symtab, &strtab, sym);
+
+  int first_global = symtab.len / sizeof(Elf64_Sym);
+
+  // References to labels that were never defined must come from
+  // other files, so such symbols are global too.
+  for (Symbol *sym = sym_head.next; sym; sym = sym->next) {
+    if (sym->section == SEC_UNDEF)
+      sym->is_global = true;
+    if (sym->is_global)
+      add_symbol(&symtab, &strtab, sym);
+  }
+
+  Bytes rela = {0};
+  for (int i = 0; i < nr_fixups; i++) {
+    Fixup *f = &fixups[i];
+    Symbol *sym = f->sym;
+    int index = sym->index;
+    int64_t addend = f->addend;
+
+    // A local symbol is not in .symtab if it is a .L label, so refer
+    // to it relative to its section instead.
+    if (!sym->is_global) {
+      index = (sym->section == SEC_TEXT) ? SYM_TEXT : SYM_DATA;
+      addend += sym->offset;
+    }
+
+    Elf64_Rela r = {
+      .r_offset = f->offset,
+      .r_info = ELF64_R_INFO(index, f->type),
+      .r_addend = addend,
+    };
+    put(&rela, &r, sizeof(r));
+  }
+
+  Bytes shstrtab = {0};
+  put8(&shstrtab, 0);
+
+  Elf64_Shdr shdrs[NR_SECTIONS] = {0};
+  shdrs[SHN_TEXT] = (Elf64_Shdr){
+    .sh_name = add_string(&shstrtab, ".text", 5),
+    .sh_type = SHT_PROGBITS,
+    .sh_flags = SHF_ALLOC | SHF_EXECINSTR,
+    .sh_size = text.len,
+    .sh_addralign = 16,
+  };
+  shdrs[SHN_DATA] = (Elf64_Shdr){
+    .sh_name = add_string(&shstrtab, ".data", 5),
+    .sh_type = SHT_PROGBITS,
+    .sh_flags = SHF_ALLOC | SHF_WRITE,
+    .sh_size = data.len,
+    .sh_addralign = 8,
+  };
+  shdrs[SHN_RELA_TEXT] = (Elf64_Shdr){
+    .sh_name = add_string(&shstrtab, ".rela.text", 10),
+    .sh_type = SHT_RELA,
+    .sh_flags = SHF_INFO_LINK,
+    .sh_size = rela.len,
+    .sh_link = SHN_SYMTAB,
+    .sh_info = SHN_TEXT,
+    .sh_addralign = 8,
+    .sh_entsize = sizeof(Elf64_Rela),
+  };
+  shdrs[SHN_SYMTAB] = (Elf64_Shdr){
+    .sh_name = add_string(&shstrtab, ".symtab", 7),
+    .sh_type = SHT_SYMTAB,
+    .sh_size = symtab.len,
+    .sh_link = SHN_STRTAB,
+    .sh_info = first_global,
+    .sh_addralign = 8,
+    .sh_entsize = sizeof(Elf64_Sym),
+  };
+  shdrs[SHN_STRTAB] = (Elf64_Shdr){
+    .sh_name = add_string(&shstrtab, ".strtab", 7),
+    .sh_type = SHT_STRTAB,
+    .sh_size = strtab.len,
+    .sh_addralign = 1,
+  };
+  shdrs[SHN_SHSTRTAB] = (Elf64_Shdr){
+    .sh_name = add_string(&shstrtab, ".shstrtab", 9),
+    .sh_type = SHT_STRTAB,
+    .sh_addralign = 1,
+  };
+  // An empty .note.GNU-stack tells the linker that the code doesn't
+  // need an executable stack.
+  shdrs[SHN_NOTE_STACK] = (Elf64_Shdr){
+    .sh_name = add_string(&shstrtab, ".note.GNU-stack", 15),
+    .sh_type = SHT_PROGBITS,
+    .sh_addralign = 1,
+  };
+  shdrs[SHN_SHSTRTAB].sh_size = shstrtab.len;
+
+  // Lay out the file: the ELF header, the contents of each section,
+  // and finally the section header table.
+  Bytes file = {0};
+  Elf64_Ehdr ehdr = {0};
+  put(&file, &ehdr, sizeof(ehdr));
+
+  Bytes *contents[NR_SECTIONS] = {
+    [SHN_TEXT] = &text, [SHN_DATA] = &data, [SHN_RELA_TEXT] = &rela,
+    [SHN_SYMTAB] = &symtab, [SHN_STRTAB] = &strtab,
+    [SHN_SHSTRTAB] = &shstrtab,
+  };
+
+  for (int i = 1; i < NR_SECTIONS; i++) {
+    align_bytes(&file, shdrs[i].sh_addralign);
+    shdrs[i].sh_offset = file.len;
+    if (contents[i])
+      put(&file, contents[i]->data, contents[i]->len);
+  }
+
+  align_bytes(&file, 8);
+  Elf64_Off shoff = file.len;
+  put(&file, shdrs, sizeof(shdrs));
+
+  ehdr = (Elf64_Ehdr){
+    .e_ident = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB,
+                EV_CURRENT, ELFOSABI_SYSV},
+    .e_type = ET_REL,
+    .e_machine = EM_X86_64,
+    .e_version = EV_CURRENT,
+    .e_shoff = shoff,
+    .e_ehsize = sizeof(Elf64_Ehdr),
+    .e_shentsize = sizeof(Elf64_Shdr),
+    .e_shnum = NR_SECTIONS,
+    .e_shstrndx = SHN_SHSTRTAB,
+  };
+  memcpy(file.data, &ehdr, sizeof(ehdr));
+
+  if (fwrite(file.data, 1, file.len, out) != file.len || fflush(out))
+    error("write failed: %s", strerror(errno));
+
+  free(file.data);
+  free(rela.data);
+  free(symtab.data);
+  free(strtab.data);
+  free(shstrtab.data);
+}
+
+// Assembles `len` bytes of assembly text generated by codegen.c and
+// writes an ELF64 relocatable object file to `out`.
+void assemble(char *p, size_t len, FILE *out) {
+  // Forget the previous file, which may have been abandoned halfway
+  // by an error.
+  for (Symbol *sym = sym_head.next, *next; sym; sym = next) {
+    next = sym->next;
+    free(sym);
+  }
+  sym_head.next = NULL;
+  sym_last = &sym_head;
+  if (syms)
+    memset(syms, 0, syms_capacity * sizeof(Symbol *));
+  syms_used = 0;
+  nr_fixups = 0;
+  text.len = data.len = 0;
+  cur_section = SEC_UNDEF;
+
+  char *end = p + len;
+
+  while (p < end) {
+    char *eol = memchr(p, '\n', end - p);
+    if (!eol)
+      eol = end;
+    assemble_line(p, eol);
+    p = eol + 1;
+  }
+
+  resolve_fixups();
+  write_object(out);
+}
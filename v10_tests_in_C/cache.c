@@ -0,0 +1,601 @@
+// This file contains the compile cache.
+//
+// With --cache-dir, the output of a compilation is stored in a cache
+// directory under a SHA-256 of everything it depends on, and a later
+// compilation of the same input picks it up from there without
+// tokenizing or parsing anything.
+//
+// The key covers the compiler executable, the options that affect the
+// output, the input path and the input's contents. Included files are
+// only known after preprocessing, so they are not in the key. Instead,
+// an entry lists the included files and their hashes, and a lookup
+// hashes those files again to make sure that none of them has changed.
+// An entry file looks like this:
+//
+//   chibicc-cache 1
+//   dep <sha256 in hex> <path>
+//   ...
+//   out <size>
+//   <output>
+//
+// Entries are written to a temporary file and renamed into place, so
+// concurrent compilers never see half-written entries. The stats file
+// at the top of the directory holds hit and miss counts and the total
+// size of the entries; it is updated under flock(). When the total
+// size exceeds the limit, the least recently used entries are removed.
+// A hit updates an entry's mtime, which serves as its last use time.
+//
+// The cache is only an optimization, so any failure to read or write
+// it just means a miss.
+//
+// The second half of this file is a finer-grained cache for
+// --incremental, which reuses the assembly of unchanged functions when
+// the rest of a file has changed.
+
+#define _DEFAULT_SOURCE
+#include "chibicc.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC "chibicc-cache 1\n"
+
+static void to_hex(uint8_t *digest, char *buf) {
+  for (int i = 0; i < 32; i++)
+    sprintf(buf + i * 2, "%02x", digest[i]);
+}
+
+static void hash_file(File *file, char *hex) {
+  Sha256 ctx;
+  uint8_t digest[32];
+  sha256_init(&ctx);
+  sha256_update(&ctx, file->contents, strlen(file->contents));
+  sha256_final(&ctx, digest);
+  to_hex(digest, hex);
+}
+
+// A rebuilt compiler may generate different code for the same
+// input, so the executable's identity is part of every key.
+static struct stat compiler_st;
+
+static void stat_compiler(void) {
+  stat("/proc/self/exe", &compiler_st);
+}
+
+void hash_compiler(Sha256 *ctx) {
+  // This is called from the codegen threads.
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, stat_compiler);
+
+  struct stat st = compiler_st;
+  sha256_update(ctx, &st.st_ino, sizeof(st.st_ino));
+  sha256_update(ctx, &st.st_size, sizeof(st.st_size));
+  sha256_update(ctx, &st.st_mtim, sizeof(st.st_mtim));
+}
+
+// Computes the cache key of a compilation. `opts` are the options
+// that can change the output.
+void cache_key(uint8_t key[32], File *input, StringArray *opts) {
+  Sha256 ctx;
+  sha256_init(&ctx);
+  sha256_str(&ctx, CACHE_MAGIC);
+  hash_compiler(&ctx);
+
+  for (int i = 0; i < opts->len; i++)
+    sha256_str(&ctx, opts->data[i]);
+
+  // Files included with "..." are searched for relative to the input.
+  sha256_str(&ctx, input->name);
+  sha256_update(&ctx, input->contents, strlen(input->contents));
+  sha256_final(&ctx, key);
+}
+
+// Returns true if a string consists of `len` lowercase hex digits.
+// Anything else in the cache directory is not an entry.
+static bool is_hex(char *s, int len) {
+  for (int i = 0; i < len; i++)
+    if (!isdigit(s[i]) && (s[i] < 'a' || 'f' < s[i]))
+      return false;
+  return s[len] == '\0';
+}
+
+static char *entry_path(char *dir, uint8_t key[32]) {
+  char hex[65];
+  to_hex(key, hex);
+  return format("%s/%.2s/%s", dir, hex, hex + 2);
+}
+
+static char *read_all(char *path, size_t *len) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return NULL;
+
+  char *buf;
+  FILE *out = open_memstream(&buf, len);
+  char tmp[65536];
+  for (size_t n; (n = fread(tmp, 1, sizeof(tmp), fp)) > 0;)
+    fwrite(tmp, 1, n, out);
+  bool err = ferror(fp);
+  fclose(fp);
+  fclose(out);
+
+  if (err) {
+    free(buf);
+    return NULL;
+  }
+  return buf;
+}
+
+typedef struct {
+  char *path;
+  struct timespec mtime;
+  off_t size;
+} Entry;
+
+static int cmp_entry(const void *x, const void *y) {
+  const Entry *a = x, *b = y;
+  if (a->mtime.tv_sec != b->mtime.tv_sec)
+    return a->mtime.tv_sec < b->mtime.tv_sec ? -1 : 1;
+  if (a->mtime.tv_nsec != b->mtime.tv_nsec)
+    return a->mtime.tv_nsec < b->mtime.tv_nsec ? -1 : 1;
+  return 0;
+}
+
+// Removes the least recently used entries until the cache takes no
+// more than 90% of max_size, so that eviction doesn't run again on
+// the very next store. Returns the new total size.
+static long evict(char *dir, size_t max_size) {
+  Entry *entries = NULL;
+  int nentries = 0, capacity = 0;
+  long total = 0;
+
+  DIR *top = opendir(dir);
+  if (!top)
+    return 0;
+
+  for (struct dirent *d; (d = readdir(top));) {
+    if (!is_hex(d->d_name, 2))
+      continue;
+
+    char *subdir = format("%s/%s", dir, d->d_name);
+    DIR *sub = opendir(subdir);
+    if (!sub) {
+      free(subdir);
+      continue;
+    }
+
+    for (struct dirent *e; (e = readdir(sub));) {
+      if (!is_hex(e->d_name, 62))
+        continue;
+
+      char *path = format("%s/%s", subdir, e->d_name);
+      struct stat st;
+      if (stat(path, &st) != 0) {
+        free(path);
+        continue;
+      }
+
+      if (nentries == capacity) {
+        capacity = capacity ? capacity * 2 : 256;
+        entries = realloc(entries, capacity * sizeof(Entry));
+      }
+      entries[nentries++] = (Entry){path, st.st_mtim, st.st_size};
+      total += st.st_size;
+    }
+    closedir(sub);
+    free(subdir);
+  }
+  closedir(top);
+
+  qsort(entries, nentries, sizeof(Entry), cmp_entry);
+
+  for (int i = 0; i < nentries; i++) {
+    if (total > max_size / 10 * 9 && unlink(entries[i].path) == 0)
+      total -= entries[i].size;
+    free(entries[i].path);
+  }
+  free(entries);
+  return total;
+}
+
+typedef struct {
+  long hits;
+  long misses;
+  long size;
+} CacheStats;
+
+static CacheStats read_stats(FILE *fp) {
+  CacheStats s = {0};
+  rewind(fp);
+  if (fscanf(fp, "hits %ld\nmisses %ld\nsize %ld\n",
+             &s.hits, &s.misses, &s.size) != 3)
+    s = (CacheStats){0};
+  return s;
+}
+
+// Adds given numbers to the stats, and evicts entries if the cache
+// has grown larger than max_size. max_size of 0 means no limit.
+static void update_stats(char *dir, int hits, int misses, long size,
+                         size_t max_size) {
+  mkdir(dir, 0755);
+  char *path = format("%s/stats", dir);
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  free(path);
+  if (fd == -1)
+    return;
+
+  FILE *fp = fdopen(fd, "r+");
+  if (!fp) {
+    close(fd);
+    return;
+  }
+  flock(fd, LOCK_EX);
+
+  CacheStats s = read_stats(fp);
+  s.hits += hits;
+  s.misses += misses;
+  s.size += size;
+  if (s.size < 0)
+    s.size = 0;
+  if (max_size && s.size > max_size)
+    s.size = evict(dir, max_size);
+
+  rewind(fp);
+  fprintf(fp, "hits %ld\nmisses %ld\nsize %ld\n", s.hits, s.misses, s.size);
+  fflush(fp);
+  ftruncate(fd, ftell(fp));
+  fclose(fp);
+}
+
+// Returns true if every file listed in the header of an entry is
+// unchanged, and sets *out to the start of the stored output.
+static bool check_entry(char *buf, size_t len, char **out, size_t *out_len) {
+  char *end = buf + len;
+  if (len < strlen(CACHE_MAGIC) || memcmp(buf, CACHE_MAGIC, strlen(CACHE_MAGIC)))
+    return false;
+
+  for (char *p = buf + strlen(CACHE_MAGIC); p < end;) {
+    char *eol = memchr(p, '\n', end - p);
+    if (!eol)
+      return false;
+    *eol = '\0';
+
+    if (!strncmp(p, "out ", 4)) {
+      char *data = eol + 1;
+      *out = data;
+      *out_len = strtoul(p + 4, NULL, 10);
+      return *out_len == end - data;
+    }
+
+    // "dep <hash> <path>"
+    if (strncmp(p, "dep ", 4) || eol - p < 4 + 64 + 2)
+      return false;
+
+    char *path = p + 4 + 64 + 1;
+    File *file = load_file(arena_strndup(&token_arena, path, eol - path));
+    if (!file)
+      return false;
+
+    char hex[65];
+    hash_file(file, hex);
+    if (memcmp(hex, p + 4, 64))
+      return false;
+    p = eol + 1;
+  }
+  return false;
+}
+
+// Looks up the cache. On a hit, returns the stored output in a
+// malloc()ed buffer and its length in *len. Returns NULL on a miss.
+char *cache_get(char *dir, uint8_t key[32], size_t *len) {
+  char *path = entry_path(dir, key);
+  size_t buf_len;
+  char *buf = read_all(path, &buf_len);
+
+  char *data;
+  bool hit = buf && check_entry(buf, buf_len, &data, len);
+
+  if (hit) {
+    memmove(buf, data, *len);
+    utimensat(AT_FDCWD, path, NULL, 0);
+  } else {
+    free(buf);
+    buf = NULL;
+  }
+
+  update_stats(dir, hit, !hit, 0, 0);
+  free(path);
+  return buf;
+}
+
+// Stores the output of a compilation that has been written to
+// output_path. The files read besides the input are recorded as its
+// dependencies.
+void cache_put(char *dir, size_t max_size, uint8_t key[32], File *input,
+               char *output_path) {
+  // Output written to stdout cannot be read back.
+  if (!output_path || !strcmp(output_path, "-"))
+    return;
+
+  size_t out_len;
+  char *out = read_all(output_path, &out_len);
+  if (!out)
+    return;
+
+  char *path = entry_path(dir, key);
+  char *subdir = format("%.*s", (int)(strrchr(path, '/') - path), path);
+  char *tmpl = format("%s/tmp.XXXXXX", subdir);
+  mkdir(dir, 0755);
+  mkdir(subdir, 0755);
+  free(subdir);
+
+  int fd = mkstemp(tmpl);
+  if (fd == -1) {
+    free(out);
+    free(path);
+    free(tmpl);
+    return;
+  }
+
+  // mkstemp() creates the file only readable by its owner.
+  fchmod(fd, 0644);
+
+  FILE *fp = fdopen(fd, "w");
+  fputs(CACHE_MAGIC, fp);
+
+  int nfiles;
+  File **files = get_input_files(&nfiles);
+  bool ok = true;
+
+  for (int i = 0; i < nfiles; i++) {
+    File *file = files[i];
+    if (!file->owns_contents || file == input)
+      continue;
+    if (strchr(file->name, '\n'))
+      ok = false;
+
+    // A file may have been read more than once.
+    bool dup = false;
+    for (int j = 0; j < i && !dup; j++)
+      dup = files[j]->owns_contents && !strcmp(files[j]->name, file->name);
+    if (dup)
+      continue;
+
+    char hex[65];
+    hash_file(file, hex);
+    fprintf(fp, "dep %s %s\n", hex, file->name);
+  }
+
+  fprintf(fp, "out %zu\n", out_len);
+  fwrite(out, 1, out_len, fp);
+  ok = !ferror(fp) && ok;
+  long size = ftell(fp);
+  ok = fclose(fp) == 0 && ok;
+
+  struct stat st;
+  long old_size = stat(path, &st) == 0 ? st.st_size : 0;
+
+  if (ok && rename(tmpl, path) == 0)
+    update_stats(dir, 0, 0, size - old_size, max_size);
+  else
+    unlink(tmpl);
+
+  free(out);
+  free(path);
+  free(tmpl);
+}
+
+void print_cache_stats(char *dir) {
+  CacheStats s = {0};
+  char *path = format("%s/stats", dir);
+  FILE *fp = fopen(path, "r");
+  free(path);
+  if (fp) {
+    s = read_stats(fp);
+    fclose(fp);
+  }
+
+  long total = s.hits + s.misses;
+  printf("cache directory: %s\n", dir);
+  printf("hits: %ld\n", s.hits);
+  printf("misses: %ld\n", s.misses);
+  printf("hit rate: %.1f%%\n", total ? 100.0 * s.hits / total : 0.0);
+  printf("size: %ld bytes\n", s.size);
+}
+
+//
+// Function cache
+//
+// With --incremental, the assembly of each function is saved to a
+// sidecar file next to the output, keyed by a hash of everything the
+// assembly depends on: the function's tokens and the declarations of
+// the global variables it refers to. The next compilation of the file
+// copies the assembly of every function whose hash is unchanged
+// instead of generating it again.
+//
+// This relies on the assembly of a function not depending on other
+// functions. Labels are numbered per function, and so are the
+// anonymous globals holding string literals (see new_unique_name()).
+// Calls refer to functions by name only, and a call always has type
+// int.
+//
+// The sidecar file holds "chibicc-fn 1\n" followed by a record per
+// function: the hash, the length as a 64-bit integer, and the
+// assembly.
+
+#define FN_MAGIC "chibicc-fn 1\n"
+
+typedef struct {
+  uint8_t *key; // NULL if the slot is empty
+  char *data;
+  size_t len;
+} Fragment;
+
+// Contents of the loaded sidecar file, and a hash table of the
+// fragments in it
+static char *fn_cache;
+static Fragment *fragments;
+static int fragments_capacity;
+static int nr_fragments;
+
+static void hash_type(Sha256 *ctx, Type *ty) {
+  if (!ty) {
+    sha256_update(ctx, "", 1);
+    return;
+  }
+
+  int buf[3] = {ty->kind, ty->size, ty->array_len};
+  sha256_update(ctx, buf, sizeof(buf));
+  hash_type(ctx, ty->base);
+  if (ty->kind == TY_FUNC) {
+    hash_type(ctx, ty->return_ty);
+    sha256_update(ctx, &ty->nparams, sizeof(ty->nparams));
+    for (int i = 0; i < ty->nparams; i++)
+      hash_type(ctx, ty->params[i]);
+  }
+}
+
+// Computes the hash of a function definition for the function cache.
+void hash_function(Obj *fn, uint8_t key[32]) {
+  Sha256 ctx;
+  sha256_init(&ctx);
+  sha256_str(&ctx, FN_MAGIC);
+  hash_compiler(&ctx);
+
+  // Tokens are short, so they are batched up rather than hashed one
+  // by one. Each is followed by '\0' to keep them apart.
+  char buf[4096];
+  int len = 0;
+
+  for (Token *tok = fn->tok; tok != fn->end; tok++) {
+    if (len + tok->len + 1 > sizeof(buf)) {
+      sha256_update(&ctx, buf, len);
+      len = 0;
+    }
+    if (tok->len + 1 > sizeof(buf)) {
+      sha256_update(&ctx, token_text(tok), tok->len);
+      sha256_update(&ctx, "", 1);
+      continue;
+    }
+    memcpy(buf + len, token_text(tok), tok->len);
+    buf[len + tok->len] = '\0';
+    len += tok->len + 1;
+  }
+  sha256_update(&ctx, buf, len);
+
+  // The code also depends on the declarations of the global variables
+  // the function refers to.
+  for (int i = 0; i < fn->nr_globals_used; i++) {
+    Obj *var = fn->globals_used[i];
+    sha256_str(&ctx, var->name);
+    hash_type(&ctx, var->ty);
+  }
+  sha256_final(&ctx, key);
+}
+
+static Fragment *fragment_slot(uint8_t *key) {
+  uint32_t h;
+  memcpy(&h, key, sizeof(h));
+  for (int i = h & (fragments_capacity - 1);; i = (i + 1) & (fragments_capacity - 1))
+    if (!fragments[i].key || !memcmp(fragments[i].key, key, 32))
+      return &fragments[i];
+}
+
+// Reads the sidecar file at `path`, if any.
+void load_fragments(char *path) {
+  free(fn_cache);
+  free(fragments);
+  fragments = NULL;
+  fragments_capacity = 0;
+  nr_fragments = 0;
+
+  size_t len;
+  fn_cache = read_all(path, &len);
+  if (!fn_cache)
+    return;
+
+  if (len < strlen(FN_MAGIC) || memcmp(fn_cache, FN_MAGIC, strlen(FN_MAGIC)))
+    return;
+
+  // Count the records first to size the hash table.
+  int n = 0;
+  char *end = fn_cache + len;
+  char *p = fn_cache + strlen(FN_MAGIC);
+
+  for (char *q = p; end - q >= 40; n++) {
+    uint64_t size;
+    memcpy(&size, q + 32, 8);
+    if (size > end - q - 40)
+      break;
+    q += 40 + size;
+  }
+
+  fragments_capacity = 16;
+  while (fragments_capacity < n * 2)
+    fragments_capacity *= 2;
+  fragments = calloc(fragments_capacity, sizeof(Fragment));
+
+  for (int i = 0; i < n; i++) {
+    uint64_t size;
+    memcpy(&size, p + 32, 8);
+    Fragment *frag = fragment_slot((uint8_t *)p);
+    if (!frag->key)
+      nr_fragments++;
+    *frag = (Fragment){(uint8_t *)p, p + 40, size};
+    p += 40 + size;
+  }
+}
+
+// Returns the assembly of a function with a given hash if the sidecar
+// file has it, or NULL.
+char *find_fragment(uint8_t key[32], size_t *len) {
+  if (!fragments)
+    return NULL;
+
+  Fragment *frag = fragment_slot(key);
+  if (!frag->key)
+    return NULL;
+  *len = frag->len;
+  return frag->data;
+}
+
+// Replaces the sidecar file with the assembly of the current
+// functions. Fragments of functions that are gone are dropped.
+void save_fragments(char *path, uint8_t (*keys)[32], char **bufs,
+                    size_t *lens, int n) {
+  // Nothing to do if the file holds exactly these functions already.
+  if (n == nr_fragments) {
+    int i = 0;
+    size_t len;
+    while (i < n && find_fragment(keys[i], &len))
+      i++;
+    if (i == n)
+      return;
+  }
+
+  char *tmpl = format("%s.XXXXXX", path);
+  int fd = mkstemp(tmpl);
+  if (fd == -1) {
+    free(tmpl);
+    return;
+  }
+  fchmod(fd, 0644);
+
+  FILE *fp = fdopen(fd, "w");
+  fputs(FN_MAGIC, fp);
+  for (int i = 0; i < n; i++) {
+    uint64_t len = lens[i];
+    fwrite(keys[i], 32, 1, fp);
+    fwrite(&len, 8, 1, fp);
+    fwrite(bufs[i], 1, len, fp);
+  }
+
+  bool ok = !ferror(fp);
+  ok = fclose(fp) == 0 && ok;
+  if (!ok || rename(tmpl, path) != 0)
+    unlink(tmpl);
+  free(tmpl);
+}
@@ -2,20 +2,70 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 typedef struct Type Type;
 typedef struct Node Node;
+typedef struct Obj Obj;
+
+#define unreachable() \
+  error("internal error at %s:%d", __FILE__, __LINE__)
+
+//
+// alloc.c
+//
+
+typedef struct ArenaChunk ArenaChunk;
+
+// Bump-pointer allocator. Objects allocated from an arena are
+// zero-initialized and released all at once by arena_reset().
+typedef struct Arena Arena;
+struct Arena {
+  char *name;
+  ArenaChunk *head; // All chunks owned by this arena
+  ArenaChunk *cur;  // Chunk currently being allocated from
+  char *ptr;        // Next free byte in `cur`
+  char *end;        // End of `cur`
+
+  // Statistics
+  size_t nr_allocs; // Number of allocations since the last reset
+  size_t used;      // Bytes handed out since the last reset
+  size_t reserved;  // Bytes obtained from malloc
+  int nr_chunks;
+};
+
+extern Arena token_arena; // Tokens and string literal contents
+extern Arena node_arena;  // AST nodes and variables
+extern Arena type_arena;  // Types
+extern Arena scope_arena; // Block scopes
+extern Arena *arenas[];   // NULL-terminated list of the above
+
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_strndup(Arena *arena, char *p, size_t len);
+void arena_reset(Arena *arena);
+void arena_reset_all(void);
 
 //
 // strings.c
 //
 
+typedef struct {
+  char **data;
+  int capacity;
+  int len;
+} StringArray;
+
+void strarray_push(StringArray *arr, char *s);
 char *format(char *fmt, ...);
+char *intern(char *p, int len);
+void reset_interner(void);
 
 //
 // tokenize.c
@@ -31,32 +81,127 @@ typedef enum {
   TK_EOF,     // End-of-file markers
 } TokenKind;
 
+// Punctuator and keyword IDs, assigned once by the tokenizer so that
+// the parser can dispatch on integers instead of comparing strings.
+// A single-character punctuator uses its own character code as its
+// ID, e.g. `tok->id == '+'`.
+typedef enum {
+  PU_EQ = 256, // ==
+  PU_NE,       // !=
+  PU_LE,       // <=
+  PU_GE,       // >=
+  PU_LOGAND,   // &&
+  PU_LOGOR,    // ||
+  PU_SHL,      // <<
+  PU_SHR,      // >>
+  PU_HASHHASH, // ##
+  KW_RETURN,
+  KW_IF,
+  KW_ELSE,
+  KW_FOR,
+  KW_WHILE,
+  KW_INT,
+  KW_SIZEOF,
+  KW_CHAR,
+} TokenId;
+
+// Source file
+typedef struct {
+  char *name;
+  int file_no;          // Index in the list of input files
+  char *contents;       // Terminated with "\n\0"
+  uint32_t *line_starts; // line_starts[i] is the offset of line i+1
+  int nr_lines;
+
+  // Set for files read by tokenize_file(), whose contents are
+  // released by reset_tokenizer()
+  bool owns_contents;
+  size_t map_len;       // Size of the mapping, if contents are mmap()ed
+} File;
+
 // Token type
+//
+// Tokens are stored in a contiguous array that ends with a TK_EOF
+// token, so the token following `tok` is simply `tok + 1`.
 typedef struct Token Token;
 struct Token {
   TokenKind kind; // Token kind
-  Token *next;    // Next token
-  int val;        // If kind is TK_NUM, its value
-  char *loc;      // Token location
-  int len;        // Token length
-  Type *ty;       // Used if TK_STR
-  char *str;      // String literal contents including terminating '\0'
+  int id;         // If kind is TK_PUNCT or TK_KEYWORD, its TokenId
+  uint32_t pos;   // Offset of the token in its file
+  uint32_t len;   // Token length
+  int line_no;    // Line number
+  int col;        // Column number, 1-based
+  int file_no;    // Source file, see get_file()
+  bool at_bol;    // True if this token is at the beginning of a line
+  bool has_space; // True if this token follows a space character
+  bool no_expand; // True if this token must not be macro-expanded
+  union {
+    int val;      // If kind is TK_NUM, its value.
+                  // If kind is TK_STR, its index in the string table
+    char *ident;  // If kind is TK_IDENT or TK_KEYWORD, its interned name
+  };
 };
 
-void error(char *fmt, ...);
+// String literal contents. They are kept out of line in a side
+// table because only string literal tokens need them.
+typedef struct {
+  char *str; // Contents including terminating '\0'
+  int len;   // Length including terminating '\0'
+} StrLit;
+
+// Error recovery. When an error is reported while error_recover is
+// set, the reporting function longjmps there instead of exiting, so
+// that the tokenizer or the parser can skip the offending construct
+// and go on to find more errors. This continues until max_errors
+// errors have been reported (0 means no limit).
+extern int max_errors;
+extern int nr_errors;
+extern jmp_buf *error_recover;
+extern Token *error_token; // Token of the last error, if any
+
+// If set, a fatal error longjmps here with the exit status plus 1
+// instead of exiting, so that the compile server survives a request
+// that fails. It is per thread; see text_worker() for the codegen
+// threads.
+extern _Thread_local jmp_buf *exit_recover;
+
+_Noreturn void exit_compiler(int status);
+_Noreturn void error(char *fmt, ...);
 void error_at(char *loc, char *fmt, ...);
 void error_tok(Token *tok, char *fmt, ...);
 bool equal(Token *tok, char *op);
 Token *skip(Token *tok, char *op);
 bool consume(Token **rest, Token *tok, char *str);
+StrLit *str_literal(Token *tok);
+File *get_file(Token *tok);
+char *token_text(Token *tok);
+File *new_file(char *name, char *contents);
+File **get_input_files(int *len);
+File *load_file(char *path);
+Token *tokenize(File *file);
 Token *tokenize_file(char *filename);
+void reset_tokenizer(void);
+
+//
+// preprocess.c
+//
+
+void add_include_path(char *path);
+void define_macro(char *name, char *buf);
+Token *preprocess(Token *tok);
+void reset_preprocessor(void);
+char *macro_definitions(void);
+char *preprocessor_env(void);
+
+// Global variables of the precompiled header used by the current
+// file, if any
+extern Obj *pch_globals;
 
 //
 // parse.c
 //
 
 // Variable or function
-typedef struct Obj Obj;
 struct Obj {
   Obj *next;
   char *name;    // Variable name
@@ -77,6 +222,14 @@ struct Obj {
   Node *body;
   Obj *locals;
   int stack_size;
+  Token *tok;    // First token of the definition
+  Token *end;    // Token following the definition
+
+  // Global variables the body refers to, recorded by the parser
+  // because constant folding, e.g. of sizeof, may remove the
+  // references from the AST
+  Obj **globals_used;
+  int nr_globals_used;
 };
 
 // AST node
@@ -105,34 +258,54 @@ typedef enum {
 } NodeKind;
 
 // AST node type
+//
+// The fields after `tok` depend on the node kind and overlap each
+// other. A node is allocated only as large as its kind needs (see
+// new_node()), so e.g. an ND_NUM leaf takes 40 bytes rather than the
+// size of the whole struct. Never access a member that doesn't belong
+// to the node's kind.
 struct Node {
   NodeKind kind; // Node kind
   Node *next;    // Next node
   Type *ty;      // Type, e.g. int or pointer to int
   Token *tok;    // Representative token
 
-  Node *lhs;     // Left-hand side
-  Node *rhs;     // Right-hand side
-
-  // "if" or "for" statement
-  Node *cond;
-  Node *then;
-  Node *els;
-  Node *init;
-  Node *inc;
-
-  // Block or statement expression
-  Node *body;
-
-  // Function call
-  char *funcname;
-  Node *args;
-
-  Obj *var;      // Used if kind == ND_VAR
-  int val;       // Used if kind == ND_NUM
+  union {
+    // Operators, "return" and expression statement.
+    // Unary operators use only `lhs`.
+    struct {
+      Node *lhs;     // Left-hand side
+      Node *rhs;     // Right-hand side
+    };
+
+    // "if" or "for" statement
+    struct {
+      Node *cond;
+      Node *then;
+      Node *els;
+      Node *init;
+      Node *inc;
+    };
+
+    // Block or statement expression
+    Node *body;
+
+    // Function call
+    struct {
+      char *funcname;
+      Node *args;
+    };
+
+    Obj *var;      // Used if kind == ND_VAR
+    int val;       // Used if kind == ND_NUM
+  };
 };
 
+extern int nr_expr_nodes;
+
+void declare_globals(Obj *vars);
 Obj *parse(Token *tok);
+void reset_parser(void);
 
 //
 // type.c
@@ -146,6 +319,11 @@ typedef enum {
   TY_ARRAY,
 } TypeKind;
 
+// Types are hash-consed: the constructors in type.c return an
+// existing Type if a structurally identical one has been created
+// before. So there is only one Type object for each distinct type,
+// two types are the same if and only if their pointers are equal,
+// and a Type must never be modified after it is created.
 struct Type {
   TypeKind kind;
   int size;      // sizeof() value
@@ -160,25 +338,22 @@ struct Type {
   // the C spec.
   Type *base;
 
-  // Declaration
-  Token *name;
-
   // Array
   int array_len;
 
   // Function type
   Type *return_ty;
-  Type *params;
-  Type *next;
+  Type **params;
+  int nparams;
 };
 
 extern Type *ty_char;
 extern Type *ty_int;
+extern int nr_type_visits;
 
 bool is_integer(Type *ty);
-Type *copy_type(Type *ty);
 Type *pointer_to(Type *base);
-Type *func_type(Type *return_ty);
+Type *func_type(Type *return_ty, Type **params, int nparams);
 Type *array_of(Type *base, int size);
 void add_type(Node *node);
 
@@ -186,4 +361,101 @@ void add_type(Node *node);
 // codegen.c
 //
 
-void codegen(Obj *prog, FILE *out);
+void codegen(Obj *prog, FILE *out, int nthreads, bool emit_obj,
+             char *fn_cache);
+void reset_codegen(void);
+
+//
+// assemble.c
+//
+
+void assemble(char *p, size_t len, FILE *out);
+
+//
+// sha256.c
+//
+
+typedef struct {
+  uint32_t h[8];
+  uint64_t len;
+  uint8_t buf[64];
+} Sha256;
+
+void sha256_init(Sha256 *ctx);
+void sha256_update(Sha256 *ctx, void *data, size_t len);
+void sha256_final(Sha256 *ctx, uint8_t digest[32]);
+void sha256_str(Sha256 *ctx, char *s);
+
+//
+// cache.c
+//
+
+void hash_compiler(Sha256 *ctx);
+void cache_key(uint8_t key[32], File *input, StringArray *opts);
+char *cache_get(char *dir, uint8_t key[32], size_t *len);
+void cache_put(char *dir, size_t max_size, uint8_t key[32], File *input,
+               char *output_path);
+void print_cache_stats(char *dir);
+void hash_function(Obj *fn, uint8_t key[32]);
+void load_fragments(char *path);
+char *find_fragment(uint8_t key[32], size_t *len);
+void save_fragments(char *path, uint8_t (*keys)[32], char **bufs,
+                    size_t *lens, int n);
+
+//
+// pch.c
+//
+
+void write_pch(char *path, char *env, Obj *prog);
+char *read_pch(char *path, char *env, Obj **vars);
+
+//
+// stats.c
+//
+
+typedef enum {
+  PH_READ_FILE,
+  PH_TOKENIZE,
+  PH_PREPROCESS,
+  PH_PARSE,
+  PH_ADD_TYPE,
+  PH_CODEGEN,
+  PH_ASSEMBLE,
+  NR_PHASES,
+} Phase;
+
+// Counters reported by --stats
+typedef struct {
+  long tokens;
+  long nodes;
+  long types;           // Types created, not found by hash-consing
+  long objs;            // Variables and functions
+  long find_var_calls;
+  long find_var_probes; // Hash table slots examined by find_var()
+  long insns;           // Instructions in the assembly output
+  long lines;           // Lines of the assembly output
+} Stats;
+
+extern bool stats_enabled;
+extern Stats stats;
+
+void phase_begin(Phase phase);
+void phase_end(Phase phase);
+void reset_stats(void);
+void count_output(char *p, size_t len);
+void print_stats(FILE *out, char *input, bool json);
+
+// Set by start_trace() for --trace
+extern bool trace_enabled;
+
+double trace_now(void);
+void trace_event(char *cat, char *name, double start);
+void start_trace(char *path);
+void flush_trace(void);
+
+//
+// server.c
+//
+
+_Noreturn void run_server(char *path, int nworkers, int (*compile)(char **argv));
+int run_client(char *path, char **argv);
@@ -1,33 +1,146 @@
 #include "chibicc.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
 
 /* a change here is that all the printf()s that emitted assembly
- * are now replaced by println(), which basically writes to the output_file
- * pointer which is initialised by chibicc in the call to codegen()
+ * are now replaced by println(), which basically writes to the output
+ * buffer which is initialised by chibicc in the call to codegen()
  */
-static FILE *output_file;
-static int depth;
+
+// Assembly is written to a private buffer rather than through stdio.
+// A buffer that has a file descriptor is flushed to it with a single
+// write(2) whenever it fills up; one without grows in memory.
+typedef struct {
+  char *data;
+  size_t len;
+  size_t capacity;
+  int fd;
+} OutBuf;
+
+#define OUTBUF_SIZE (1 << 20)
+
+// Functions may be compiled in parallel (see emit_text()), so the
+// state of the function being compiled is thread-local.
+static _Thread_local OutBuf *output_buf;
+static _Thread_local int depth;
+static _Thread_local Obj *current_fn;
+static _Thread_local int label_count;
+
 static char *argreg8[] = {"%dil", "%sil", "%dl", "%cl", "%r8b", "%r9b"};
 static char *argreg64[] = {"%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"};
-static Obj *current_fn;
 
 static void gen_expr(Node *node);
 static void gen_stmt(Node *node);
 
+static void flush_buf(OutBuf *buf) {
+  if (stats_enabled)
+    count_output(buf->data, buf->len);
+
+  for (char *p = buf->data; p < buf->data + buf->len;) {
+    ssize_t n = write(buf->fd, p, buf->data + buf->len - p);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      error("write failed: %s", strerror(errno));
+    }
+    p += n;
+  }
+  buf->len = 0;
+}
+
+// Makes room for `n` more bytes in the output buffer.
+static void reserve(size_t n) {
+  OutBuf *buf = output_buf;
+  if (buf->capacity - buf->len >= n)
+    return;
+
+  if (buf->fd != -1) {
+    flush_buf(buf);
+    if (buf->capacity >= n)
+      return;
+  }
+
+  size_t capacity = buf->capacity ? buf->capacity * 2 : 4096;
+  while (capacity - buf->len < n)
+    capacity *= 2;
+  buf->data = realloc(buf->data, capacity);
+  if (!buf->data)
+    error("out of memory");
+  buf->capacity = capacity;
+}
+
+static void emit(char *s, size_t len) {
+  reserve(len);
+  memcpy(output_buf->data + output_buf->len, s, len);
+  output_buf->len += len;
+}
+
+static void emit_str(char *s) {
+  emit(s, strlen(s));
+}
+
+static void emit_int(int val) {
+  char tmp[16];
+  char *p = tmp + sizeof(tmp);
+  unsigned u = (val < 0) ? -(unsigned)val : val;
+
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  if (val < 0)
+    *--p = '-';
+  emit(p, tmp + sizeof(tmp) - p);
+}
+
+// Emits a line that needs no formatting. The length of the string
+// literal is computed at compile time.
+#define emitln(s) emit(s "\n", sizeof(s "\n") - 1)
+
+// Emits a formatted line. Only the directives we use, %s, %d and
+// %%, are supported.
 static void println(char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  vfprintf(output_file, fmt, ap);
+
+  for (char *p = fmt;;) {
+    char *q = p;
+    while (*q && *q != '%')
+      q++;
+    emit(p, q - p);
+    if (!*q)
+      break;
+
+    switch (q[1]) {
+    case 's':
+      emit_str(va_arg(ap, char *));
+      break;
+    case 'd':
+      emit_int(va_arg(ap, int));
+      break;
+    case '%':
+      emit("%", 1);
+      break;
+    default:
+      unreachable();
+    }
+    p = q + 2;
+  }
+
   va_end(ap);
-  fprintf(output_file, "\n");
+  emit("\n", 1);
 }
 
+// Returns a new label number. Label numbers are local to a function
+// and labels include the function name, so that the code generated
+// for a function doesn't depend on any other function.
 static int count(void) {
-  static int i = 1;
-  return i++;
+  return ++label_count;
 }
 
 static void push(void) {
-  println("  push %%rax");
+  emitln("  push %rax");
   depth++;
 }
 
@@ -76,9 +189,9 @@ static void load(Type *ty) {
   }
 
   if (ty->size == 1)
-    println("  movsbq (%%rax), %%rax");
+    emitln("  movsbq (%rax), %rax");
   else
-    println("  mov (%%rax), %%rax");
+    emitln("  mov (%rax), %rax");
 }
 
 // Store %rax to an address that the stack top is pointing to.
@@ -86,9 +199,9 @@ static void store(Type *ty) {
   pop("%rdi");
 
   if (ty->size == 1)
-    println("  mov %%al, (%%rdi)");
+    emitln("  mov %al, (%rdi)");
   else
-    println("  mov %%rax, (%%rdi)");
+    emitln("  mov %rax, (%rdi)");
 }
 
 // Generate code for a given node.
@@ -99,7 +212,7 @@ static void gen_expr(Node *node) {
     return;
   case ND_NEG:
     gen_expr(node->lhs);
-    println("  neg %%rax");
+    emitln("  neg %rax");
     return;
   case ND_VAR:
     gen_addr(node);
@@ -133,7 +246,7 @@ static void gen_expr(Node *node) {
     for (int i = nargs - 1; i >= 0; i--)
       pop(argreg64[i]);
 
-    println("  mov $0, %%rax");
+    emitln("  mov $0, %rax");
     println("  call %s", node->funcname);
     return;
   }
@@ -146,34 +259,34 @@ static void gen_expr(Node *node) {
 
   switch (node->kind) {
   case ND_ADD:
-    println("  add %%rdi, %%rax");
+    emitln("  add %rdi, %rax");
     return;
   case ND_SUB:
-    println("  sub %%rdi, %%rax");
+    emitln("  sub %rdi, %rax");
     return;
   case ND_MUL:
-    println("  imul %%rdi, %%rax");
+    emitln("  imul %rdi, %rax");
     return;
   case ND_DIV:
-    println("  cqo");
-    println("  idiv %%rdi");
+    emitln("  cqo");
+    emitln("  idiv %rdi");
     return;
   case ND_EQ:
   case ND_NE:
   case ND_LT:
   case ND_LE:
-    println("  cmp %%rdi, %%rax");
+    emitln("  cmp %rdi, %rax");
 
     if (node->kind == ND_EQ)
-      println("  sete %%al");
+      emitln("  sete %al");
     else if (node->kind == ND_NE)
-      println("  setne %%al");
+      emitln("  setne %al");
     else if (node->kind == ND_LT)
-      println("  setl %%al");
+      emitln("  setl %al");
     else if (node->kind == ND_LE)
-      println("  setle %%al");
+      emitln("  setle %al");
 
-    println("  movzb %%al, %%rax");
+    emitln("  movzb %al, %rax");
     return;
   }
 
@@ -185,31 +298,31 @@ static void gen_stmt(Node *node) {
   case ND_IF: {
     int c = count();
     gen_expr(node->cond);
-    println("  cmp $0, %%rax");
-    println("  je  .L.else.%d", c);
+    emitln("  cmp $0, %rax");
+    println("  je  .L.else.%s.%d", current_fn->name, c);
     gen_stmt(node->then);
-    println("  jmp .L.end.%d", c);
-    println(".L.else.%d:", c);
+    println("  jmp .L.end.%s.%d", current_fn->name, c);
+    println(".L.else.%s.%d:", current_fn->name, c);
     if (node->els)
       gen_stmt(node->els);
-    println(".L.end.%d:", c);
+    println(".L.end.%s.%d:", current_fn->name, c);
     return;
   }
   case ND_FOR: {
     int c = count();
     if (node->init)
       gen_stmt(node->init);
-    println(".L.begin.%d:", c);
+    println(".L.begin.%s.%d:", current_fn->name, c);
     if (node->cond) {
       gen_expr(node->cond);
-      println("  cmp $0, %%rax");
-      println("  je  .L.end.%d", c);
+      emitln("  cmp $0, %rax");
+      println("  je  .L.end.%s.%d", current_fn->name, c);
     }
     gen_stmt(node->then);
     if (node->inc)
       gen_expr(node->inc);
-    println("  jmp .L.begin.%d", c);
-    println(".L.end.%d:", c);
+    println("  jmp .L.begin.%s.%d", current_fn->name, c);
+    println(".L.end.%s.%d:", current_fn->name, c);
     return;
   }
   case ND_BLOCK:
@@ -248,7 +361,7 @@ static void emit_data(Obj *prog) {
     if (var->is_function)
       continue;
 
-    println("  .data");
+    emitln("  .data");
     println("  .globl %s", var->name);
     println("%s:", var->name);
 
@@ -261,47 +374,222 @@ static void emit_data(Obj *prog) {
   }
 }
 
-static void emit_text(Obj *prog) {
-  for (Obj *fn = prog; fn; fn = fn->next) {
-    if (!fn->is_function)
-      continue;
+static void emit_function(Obj *fn) {
+  double ts = trace_enabled ? trace_now() : 0;
+  println("  .globl %s", fn->name);
+  emitln("  .text");
+  println("%s:", fn->name);
+  current_fn = fn;
+  label_count = 0;
+  depth = 0;
+
+  // Prologue
+  emitln("  push %rbp");
+  emitln("  mov %rsp, %rbp");
+  println("  sub $%d, %%rsp", fn->stack_size);
+
+  // Save passed-by-register arguments to the stack
+  int i = 0;
+  for (Obj *var = fn->params; var; var = var->next) {
+    if (var->ty->size == 1)
+      println("  mov %s, %d(%%rbp)", argreg8[i++], var->offset);
+    else
+      println("  mov %s, %d(%%rbp)", argreg64[i++], var->offset);
+  }
+
+  // Emit code
+  gen_stmt(fn->body);
+  assert(depth == 0);
+
+  // Epilogue
+  println(".L.return.%s:", fn->name);
+  emitln("  mov %rbp, %rsp");
+  emitln("  pop %rbp");
+  emitln("  ret");
+
+  if (trace_enabled)
+    trace_event("codegen", fn->name, ts);
+}
+
+// Functions to be compiled by worker threads. Each worker repeatedly
+// takes the next function and compiles it into the function's own
+// buffer, or copies it from the function cache.
+typedef struct {
+  Obj **fns;
+  char **bufs;
+  size_t *lens;
+  uint8_t (*keys)[32]; // Hashes of the functions with --incremental
+  bool *cached;        // bufs[i] points into the function cache
+  int nfns;
+  atomic_int next;
+  atomic_int status;   // Exit status plus 1 of the first error, or 0
+} TextJobs;
+
+// Buffer of the function a worker is compiling
+static _Thread_local OutBuf fn_buf;
+
+static void *text_worker(void *arg) {
+  TextJobs *jobs = arg;
+
+  // A fatal error must not longjmp() to another thread's stack, so
+  // the worker catches it here and emit_text() raises it again once
+  // all workers are done. The message has already been printed.
+  jmp_buf *saved = exit_recover;
+  jmp_buf recover;
+  int status = setjmp(recover);
+  if (status) {
+    int zero = 0;
+    atomic_compare_exchange_strong(&jobs->status, &zero, status);
+    free(fn_buf.data);
+    fn_buf = (OutBuf){0};
+    exit_recover = saved;
+    return NULL;
+  }
+  exit_recover = &recover;
 
-    println("  .globl %s", fn->name);
-    println("  .text");
-    println("%s:", fn->name);
-    current_fn = fn;
-
-    // Prologue
-    println("  push %%rbp");
-    println("  mov %%rsp, %%rbp");
-    println("  sub $%d, %%rsp", fn->stack_size);
-
-    // Save passed-by-register arguments to the stack
-    int i = 0;
-    for (Obj *var = fn->params; var; var = var->next) {
-      if (var->ty->size == 1)
-        println("  mov %s, %d(%%rbp)", argreg8[i++], var->offset);
-      else
-        println("  mov %s, %d(%%rbp)", argreg64[i++], var->offset);
+  for (;;) {
+    int i = atomic_fetch_add(&jobs->next, 1);
+    if (i >= jobs->nfns || atomic_load(&jobs->status)) {
+      exit_recover = saved;
+      return NULL;
     }
 
-    // Emit code
-    gen_stmt(fn->body);
-    assert(depth == 0);
+    if (jobs->keys) {
+      hash_function(jobs->fns[i], jobs->keys[i]);
+
+      size_t len;
+      char *p = find_fragment(jobs->keys[i], &len);
+      if (p) {
+        jobs->bufs[i] = p;
+        jobs->lens[i] = len;
+        jobs->cached[i] = true;
+        continue;
+      }
+    }
+
+    fn_buf = (OutBuf){.fd = -1};
+    output_buf = &fn_buf;
+    emit_function(jobs->fns[i]);
+    jobs->bufs[i] = fn_buf.data;
+    jobs->lens[i] = fn_buf.len;
+    fn_buf = (OutBuf){0};
+  }
+}
+
+// Emits all functions. With more than one thread, functions are
+// compiled in parallel and the results are written out in declaration
+// order, so that the output is identical to a serial run.
+//
+// If fn_cache is given, it is the path of the sidecar file of the
+// function cache, which is read and then updated.
+static void emit_text(Obj *prog, int nthreads, char *fn_cache) {
+  int nfns = 0;
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function)
+      nfns++;
+
+  if (nthreads > nfns)
+    nthreads = nfns;
+
+  if (nthreads <= 1 && !fn_cache) {
+    for (Obj *fn = prog; fn; fn = fn->next)
+      if (fn->is_function)
+        emit_function(fn);
+    return;
+  }
+
+  TextJobs jobs = {
+    .fns = calloc(nfns, sizeof(Obj *)),
+    .bufs = calloc(nfns, sizeof(char *)),
+    .lens = calloc(nfns, sizeof(size_t)),
+    .keys = fn_cache ? calloc(nfns, 32) : NULL,
+    .cached = calloc(nfns, sizeof(bool)),
+    .nfns = nfns,
+  };
+
+  int i = 0;
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function)
+      jobs.fns[i++] = fn;
+
+  if (fn_cache)
+    load_fragments(fn_cache);
+
+  pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+  if (nthreads <= 1) {
+    OutBuf *buf = output_buf;
+    text_worker(&jobs);
+    output_buf = buf;
+  } else {
+    for (int i = 0; i < nthreads; i++)
+      if (pthread_create(&threads[i], NULL, text_worker, &jobs))
+        error("pthread_create failed");
+    for (int i = 0; i < nthreads; i++)
+      pthread_join(threads[i], NULL);
+  }
+
+  int status = atomic_load(&jobs.status);
+  if (!status) {
+    for (int i = 0; i < nfns; i++)
+      emit(jobs.bufs[i], jobs.lens[i]);
 
-    // Epilogue
-    println(".L.return.%s:", fn->name);
-    println("  mov %%rbp, %%rsp");
-    println("  pop %%rbp");
-    println("  ret");
+    if (fn_cache)
+      save_fragments(fn_cache, jobs.keys, jobs.bufs, jobs.lens, nfns);
   }
+
+  for (int i = 0; i < nfns; i++)
+    if (!jobs.cached[i])
+      free(jobs.bufs[i]);
+  free(threads);
+  free(jobs.fns);
+  free(jobs.bufs);
+  free(jobs.lens);
+  free(jobs.keys);
+  free(jobs.cached);
+
+  if (status)
+    exit_compiler(status - 1);
+}
+
+// Output buffer of the codegen() call in progress. It is not on the
+// stack so that reset_codegen() can free it after an error.
+static OutBuf file_buf;
+
+// Frees the output buffer of a codegen() call that an error ended.
+void reset_codegen(void) {
+  free(file_buf.data);
+  file_buf = (OutBuf){0};
 }
 
-void codegen(Obj *prog, FILE *out) {
-  output_file = out;
+// Writes assembly for `prog` to `out`, or an object file if
+// `emit_obj` is true. In the latter case the assembly is kept in
+// memory and handed to the built-in assembler. fn_cache is the
+// sidecar file of the function cache, or NULL.
+void codegen(Obj *prog, FILE *out, int nthreads, bool emit_obj,
+             char *fn_cache) {
+  fflush(out);
+  file_buf = (OutBuf){
+    .data = malloc(OUTBUF_SIZE),
+    .capacity = OUTBUF_SIZE,
+    .fd = emit_obj ? -1 : fileno(out),
+  };
+  output_buf = &file_buf;
+  phase_begin(PH_CODEGEN);
 
   assign_lvar_offsets(prog);
 	// separate functions for emitting data and code (text)
   emit_data(prog);
-  emit_text(prog);
+  emit_text(prog, nthreads, fn_cache);
+
+  if (emit_obj) {
+    if (stats_enabled)
+      count_output(file_buf.data, file_buf.len);
+    phase_begin(PH_ASSEMBLE);
+    assemble(file_buf.data, file_buf.len, out);
+    phase_end(PH_ASSEMBLE);
+  } else {
+    flush_buf(&file_buf);
+  }
+  phase_end(PH_CODEGEN);
+  reset_codegen();
 }
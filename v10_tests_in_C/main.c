@@ -1,4 +1,10 @@
+// MAP_ANONYMOUS is not part of POSIX.
+#define _DEFAULT_SOURCE
 #include "chibicc.h"
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 /* added the following funcitonality:
  *
@@ -12,19 +18,141 @@
 // file name in which the output is to be redirected, if -o specified
 static char *opt_o;
 
-// file name from which input is to be taken
-static char *input_path;
+// files from which input is to be taken
+static StringArray input_paths;
+
+// -I and -D options, applied again for each input file
+static StringArray opt_I;
+static StringArray opt_D;
+
+// write an object file instead of assembly, -c
+static bool opt_c;
+
+// print the preprocessed tokens and stop, -E
+static bool opt_E;
+
+// number of threads used to generate code, or of files compiled in
+// parallel if there is more than one, -j
+static int opt_j = 1;
+
+// print how many times add_type() visited the expression nodes
+static bool opt_type_stats;
+
+// print the time spent in each phase and other statistics to stderr,
+// as a table or as JSON, --stats[=json]
+static bool opt_stats_json;
+
+// write a timeline of the compilation in Chrome's trace event format,
+// --trace=<path>
+static char *opt_trace;
+
+// compile cache directory, its size limit in bytes, and whether to
+// print its statistics
+static char *opt_cache_dir;
+static size_t opt_cache_size = 1 << 30;
+static bool opt_cache_stats;
+
+// reuse the code of unchanged functions from the last compilation,
+// --incremental
+static bool opt_incremental;
+
+// write a precompiled header for each input instead of compiling it,
+// --emit-pch
+static bool opt_emit_pch;
 
 // prints the usage message and exit() s with the given status code
 static void usage(int status) {
-  fprintf(stderr, "chibicc [ -o <path> ] <file>\n");
-  exit(status);
+  fprintf(stderr, "chibicc [ -c | -E ] [ -o <path> ] [ -I <dir> ] [ -D <name>[=<val>] ] [ -j <n> ] [ -fmax-errors=<n> ] [ --cache-dir=<dir> [ --cache-size=<n>[KMG] ] ] [ --incremental ] [ --stats[=json] ] [ --trace=<path> ] <file>... [ @<file> ]\n");
+  fprintf(stderr, "chibicc --emit-pch [ -o <path> ] [ -I <dir> ] [ -D <name>[=<val>] ] <header>...\n");
+  fprintf(stderr, "chibicc --cache-dir=<dir> --cache-stats\n");
+  fprintf(stderr, "chibicc --server <socket> [ -j <n> ]\n");
+  fprintf(stderr, "chibicc --client <socket> <args>...\n");
+  exit_compiler(status);
+}
+
+static void define(char *str) {
+  char *eq = strchr(str, '=');
+  if (eq)
+    define_macro(strndup(str, eq - str), eq + 1);
+  else
+    define_macro(str, "1");
+}
+
+// Arguments read from response files. They are released when the
+// compile server starts the next request.
+static Arena args_arena = {"args"};
+
+// Reads the arguments in a response file. Arguments are separated by
+// whitespace and may be quoted with '...' or "...", and a backslash
+// escapes the next character, as in GCC's response files. A response
+// file may refer to other response files.
+static void read_response_file(StringArray *args, char *path, int depth) {
+  if (depth == 10)
+    error("%s: response files nested too deeply", path);
+
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    error("cannot open response file %s: %s", path, strerror(errno));
+
+  for (int c = getc(fp); c != EOF;) {
+    if (isspace(c)) {
+      c = getc(fp);
+      continue;
+    }
+
+    char *arg;
+    size_t len;
+    FILE *buf = open_memstream(&arg, &len);
+    int quote = 0;
+
+    for (; c != EOF && (quote || !isspace(c)); c = getc(fp)) {
+      if (c == quote) {
+        quote = 0;
+      } else if (!quote && (c == '\'' || c == '"')) {
+        quote = c;
+      } else if (c == '\\' && quote != '\'') {
+        c = getc(fp);
+        if (c == EOF)
+          break;
+        putc(c, buf);
+      } else {
+        putc(c, buf);
+      }
+    }
+    fclose(buf);
+    char *s = arena_strndup(&args_arena, arg, len);
+    free(arg);
+
+    if (s[0] == '@')
+      read_response_file(args, s + 1, depth + 1);
+    else
+      strarray_push(args, s);
+  }
+  fclose(fp);
+}
+
+// Returns the arguments with each @file replaced by the contents of
+// the file. The result is NULL-terminated like argv, and is valid
+// until the next call.
+static char **expand_response_files(int argc, char **argv) {
+  static StringArray args;
+  args.len = 0;
+  arena_reset(&args_arena);
+
+  for (int i = 0; i < argc; i++) {
+    if (i > 0 && argv[i][0] == '@')
+      read_response_file(&args, argv[i] + 1, 0);
+    else
+      strarray_push(&args, argv[i]);
+  }
+  strarray_push(&args, NULL);
+  return args.data;
 }
 
 // parses the argument list given to main and sets the proper
 // option variables
-static void parse_args(int argc, char **argv) {
-  for (int i = 1; i < argc; i++) {
+static void parse_args(char **argv) {
+  for (int i = 1; argv[i]; i++) {
 
 		// --help encountered, then just print usage and exit(0)
     if (!strcmp(argv[i], "--help"))
@@ -39,6 +167,121 @@ static void parse_args(int argc, char **argv) {
       continue;
     }
 
+    if (!strcmp(argv[i], "-c")) {
+      opt_c = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-E")) {
+      opt_E = true;
+      continue;
+    }
+
+    // -I <dir>: add a directory to the #include search path
+    if (!strcmp(argv[i], "-I")) {
+      if (!argv[++i])
+        usage(1);
+      strarray_push(&opt_I, argv[i]);
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-I", 2)) {
+      strarray_push(&opt_I, argv[i] + 2);
+      continue;
+    }
+
+    // -D <name>[=<val>]: define a macro, with the value 1 by default
+    if (!strcmp(argv[i], "-D")) {
+      if (!argv[++i])
+        usage(1);
+      strarray_push(&opt_D, argv[i]);
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-D", 2)) {
+      strarray_push(&opt_D, argv[i] + 2);
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--type-stats")) {
+      opt_type_stats = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--stats") || !strcmp(argv[i], "--stats=json")) {
+      stats_enabled = true;
+      opt_stats_json = (argv[i][7] == '=');
+      continue;
+    }
+
+    if (!strncmp(argv[i], "--trace=", 8)) {
+      opt_trace = argv[i] + 8;
+      continue;
+    }
+
+    // -j N: generate code for up to N functions in parallel,
+    // 0 means one thread per CPU
+    if (!strcmp(argv[i], "-j")) {
+      if (!argv[++i])
+        usage(1);
+      opt_j = atoi(argv[i]);
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-j", 2)) {
+      opt_j = atoi(argv[i] + 2);
+      continue;
+    }
+
+    // -fmax-errors=N: report up to N errors before giving up,
+    // 0 means no limit
+    if (!strncmp(argv[i], "-fmax-errors=", 13)) {
+      max_errors = atoi(argv[i] + 13);
+      continue;
+    }
+
+    // --cache-dir=DIR: reuse the output of earlier compilations of
+    // the same input, stored in DIR
+    if (!strncmp(argv[i], "--cache-dir=", 12)) {
+      opt_cache_dir = argv[i] + 12;
+      continue;
+    }
+
+    // --cache-size=N[KMG]: evict the least recently used entries when
+    // the cache grows larger than N
+    if (!strncmp(argv[i], "--cache-size=", 13)) {
+      char *end;
+      opt_cache_size = strtoull(argv[i] + 13, &end, 10);
+      if (*end == 'K' || *end == 'k')
+        opt_cache_size <<= 10, end++;
+      else if (*end == 'M' || *end == 'm')
+        opt_cache_size <<= 20, end++;
+      else if (*end == 'G' || *end == 'g')
+        opt_cache_size <<= 30, end++;
+      if (*end || end == argv[i] + 13)
+        error("invalid cache size: %s", argv[i] + 13);
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--cache-stats")) {
+      opt_cache_stats = true;
+      continue;
+    }
+
+    // --incremental: keep the code of each function in <output>.fn
+    // and reuse it for the functions that haven't changed
+    if (!strcmp(argv[i], "--incremental")) {
+      opt_incremental = true;
+      continue;
+    }
+
+    // --emit-pch: write <header>.pch, which is used in place of the
+    // header when it is the first file included
+    if (!strcmp(argv[i], "--emit-pch")) {
+      opt_emit_pch = true;
+      continue;
+    }
+
 		// not sure about this right now
     if (!strncmp(argv[i], "-o", 2)) {
       opt_o = argv[i] + 2;
@@ -49,15 +292,26 @@ static void parse_args(int argc, char **argv) {
     if (argv[i][0] == '-' && argv[i][1] != '\0')
       error("unknown argument: %s", argv[i]);
 
-		// in the end, set the input_path 
-    input_path = argv[i];
+		// in the end, add to the input_paths
+    strarray_push(&input_paths, argv[i]);
   }
 
 	// no input_path specified 
-  if (!input_path)
+  if (input_paths.len == 0 && !opt_cache_stats)
     error("no input files");
+
+  if (opt_cache_stats && !opt_cache_dir)
+    error("--cache-stats needs --cache-dir");
+
+  if (input_paths.len > 1 && opt_o)
+    error("cannot specify '-o' with multiple files");
 }
 
+// output file that is open, if any, so that discard_output() can
+// remove it when an error ends the compilation
+static FILE *cur_out;
+static char *cur_out_path;
+
 // opens the file to which output needs to be redirected
 static FILE *open_file(char *path) {
   if (!path || strcmp(path, "-") == 0)
@@ -66,18 +320,330 @@ static FILE *open_file(char *path) {
   FILE *out = fopen(path, "w");
   if (!out)
     error("cannot open output file: %s: %s", path, strerror(errno));
+  cur_out = out;
+  cur_out_path = path;
   return out;
 }
 
-int main(int argc, char **argv) {
-  parse_args(argc, argv);
+static void close_file(FILE *out) {
+  if (out != stdout) {
+    fclose(out);
+    cur_out = NULL;
+  } else {
+    fflush(out);
+  }
+}
 
-  // Tokenize and parse.
-  Token *tok = tokenize_file(input_path);
+// Cleans up after a compilation that an error ended: the partial
+// output file is closed and removed, and the codegen buffer freed.
+static void discard_output(void) {
+  if (cur_out) {
+    fclose(cur_out);
+    unlink(cur_out_path);
+    cur_out = NULL;
+  }
+  reset_codegen();
+}
+
+// Returns the output path for an input file when there are several:
+// the input's base name with its extension replaced, e.g. "dir/foo.c"
+// becomes "foo.o" with -c and "foo.s" otherwise. A precompiled header
+// is written next to its header.
+static char *output_path(char *input) {
+  if (opt_emit_pch)
+    return format("%s.pch", input);
+
+  char *base = strrchr(input, '/');
+  base = base ? base + 1 : input;
+
+  char *dot = strrchr(base, '.');
+  int len = dot ? dot - base : strlen(base);
+  return format("%.*s.%s", len, base, opt_c ? "o" : "s");
+}
+
+// prints the preprocessed tokens for -E
+static void print_tokens(Token *tok, FILE *out) {
+  for (Token *t = tok; t->kind != TK_EOF; t++) {
+    if (t == tok)
+      ;
+    else if (t->at_bol)
+      fprintf(out, "\n");
+    else if (t->has_space)
+      fprintf(out, " ");
+    fprintf(out, "%.*s", t->len, token_text(t));
+  }
+  fprintf(out, "\n");
+}
+
+// Clears everything left over from compiling the previous file.
+// Types are kept: they don't refer to anything else, and the
+// hash-consing table can be shared by all files.
+static void reset_state(void) {
+  arena_reset(&token_arena);
+  arena_reset(&node_arena);
+  arena_reset(&scope_arena);
+  reset_interner();
+  reset_tokenizer();
+  reset_preprocessor();
+  reset_parser();
+  nr_type_visits = 0;
+
+  for (int i = 0; i < opt_I.len; i++)
+    add_include_path(opt_I.data[i]);
+  for (int i = 0; i < opt_D.len; i++)
+    define(opt_D.data[i]);
+}
+
+// Computes the compile cache key of an input file from its contents
+// and the options that affect the output.
+static void get_cache_key(uint8_t key[32], File *file) {
+  StringArray opts = {0};
+  strarray_push(&opts, opt_c ? "-c" : "-S");
+  for (int i = 0; i < opt_I.len; i++)
+    strarray_push(&opts, format("-I%s", opt_I.data[i]));
+  for (int i = 0; i < opt_D.len; i++)
+    strarray_push(&opts, format("-D%s", opt_D.data[i]));
+
+  cache_key(key, file, &opts);
+
+  for (int i = 1; i < opts.len; i++)
+    free(opts.data[i]);
+  free(opts.data);
+}
+
+static void compile(char *input_path, char *output_path, int nthreads) {
+  File *file = load_file(input_path);
+  if (!file)
+    error("cannot open %s: %s", input_path, strerror(errno));
+
+  // A cache hit skips everything below. -E output is not cached, and
+  // neither is a compilation whose statistics are wanted.
+  bool use_cache = opt_cache_dir && !opt_E && !opt_type_stats &&
+                   !stats_enabled && !opt_emit_pch;
+  uint8_t key[32];
+
+  if (use_cache) {
+    get_cache_key(key, file);
+
+    size_t len;
+    char *buf = cache_get(opt_cache_dir, key, &len);
+    if (buf) {
+      FILE *out = open_file(output_path);
+      fwrite(buf, 1, len, out);
+      close_file(out);
+      free(buf);
+      return;
+    }
+  }
+
+  // A precompiled header is valid for the preprocessor state it was
+  // made in, i.e. the one set up by the options.
+  char *pch_env = opt_emit_pch ? preprocessor_env() : NULL;
+
+  // Tokenize, preprocess and parse.
+  Token *tok = preprocess(tokenize(file));
+
+  if (opt_E) {
+    FILE *out = open_file(output_path);
+    print_tokens(tok, out);
+    close_file(out);
+    return;
+  }
+
+  declare_globals(pch_globals);
   Obj *prog = parse(tok);
+  if (nr_errors)
+    exit_compiler(1);
+
+  if (opt_emit_pch) {
+    char *path = output_path ? NULL : format("%s.pch", input_path);
+    write_pch(path ? path : output_path, pch_env, prog);
+    free(path);
+    free(pch_env);
+    return;
+  }
+
+  if (opt_type_stats)
+    fprintf(stderr, "expression nodes: %d\nadd_type visits: %d\n",
+            nr_expr_nodes, nr_type_visits);
+
+  // Traverse the AST to emit assembly, or an object file with -c.
+  // The function cache lives next to the output, so there is none
+  // for output to stdout.
+  char *fn_cache = NULL;
+  if (opt_incremental && output_path && strcmp(output_path, "-"))
+    fn_cache = format("%s.fn", output_path);
+
+  FILE *out = open_file(output_path);
+  codegen(prog, out, nthreads, opt_c, fn_cache);
+  close_file(out);
+  free(fn_cache);
+
+  if (use_cache)
+    cache_put(opt_cache_dir, opt_cache_size, key, file, output_path);
+}
+
+// Compiles one file. Exits on error.
+static void compile_file(char *input_path, char *output_path,
+                         int nthreads) {
+  reset_state();
+  if (stats_enabled || trace_enabled)
+    reset_stats();
+  double ts = trace_enabled ? trace_now() : 0;
+
+  compile(input_path, output_path, nthreads);
+
+  if (stats_enabled)
+    print_stats(stderr, input_path, opt_stats_json);
+  if (trace_enabled) {
+    trace_event("compile", input_path, ts);
+    flush_trace();
+  }
+}
+
+// Compiles several files with a pool of worker processes.
+//
+// The workers take the next file from a counter in shared memory, so
+// a worker that got a big file doesn't hold up the rest. A worker
+// reuses its arenas and tables from one file to the next. Errors
+// still exit(), which ends the worker in the middle of its file; a
+// new worker is then started for the files that remain, and the
+// result is a failure.
+static bool compile_files(int nworkers) {
+  int n = input_paths.len;
+  atomic_int *next = mmap(NULL, sizeof(atomic_int), PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (next == MAP_FAILED)
+    error("mmap failed: %s", strerror(errno));
+  atomic_init(next, 0);
+
+  if (nworkers > n)
+    nworkers = n;
+
+  // Don't let the workers inherit unflushed output.
+  fflush(NULL);
+
+  bool ok = true;
+  int live = 0;
+
+  for (;;) {
+    while (live < nworkers && atomic_load(next) < n) {
+      pid_t pid = fork();
+      if (pid == -1)
+        error("fork failed: %s", strerror(errno));
+
+      if (pid == 0) {
+        exit_recover = NULL;
+        for (int i; (i = atomic_fetch_add(next, 1)) < n;) {
+          char *path = output_path(input_paths.data[i]);
+          compile_file(input_paths.data[i], path, 1);
+          free(path);
+        }
+        exit(0);
+      }
+      live++;
+    }
+
+    if (live == 0)
+      break;
+
+    int status;
+    if (wait(&status) == -1)
+      error("wait failed: %s", strerror(errno));
+    live--;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      // Start no more than one worker for each file that failed.
+      ok = false;
+      nworkers = live + 1;
+    }
+  }
+
+  munmap(next, sizeof(atomic_int));
+  return ok;
+}
+
+// Runs the compiler with given arguments and returns the exit status.
+static int run(int argc, char **argv) {
+  parse_args(expand_response_files(argc, argv));
+
+  if (opt_cache_stats) {
+    print_cache_stats(opt_cache_dir);
+    return 0;
+  }
+
+  if (opt_j <= 0)
+    opt_j = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (opt_trace)
+    start_trace(opt_trace);
+
+  if (input_paths.len == 1) {
+    compile_file(input_paths.data[0], opt_o, opt_j);
+    return 0;
+  }
+
+  // -E writes all files to stdout, so they are done one by one.
+  if (opt_E) {
+    for (int i = 0; i < input_paths.len; i++)
+      compile_file(input_paths.data[i], NULL, 1);
+    return 0;
+  }
+
+  return compile_files(opt_j) ? 0 : 1;
+}
+
+// Compiles on behalf of a client of the compile server. Options are
+// reset to their defaults first, and an error ends the request rather
+// than the server.
+static int serve_request(char **argv) {
+  opt_o = NULL;
+  input_paths.len = 0;
+  opt_I.len = 0;
+  opt_D.len = 0;
+  opt_c = opt_E = opt_type_stats = false;
+  opt_cache_dir = NULL;
+  opt_cache_size = 1 << 30;
+  opt_cache_stats = false;
+  opt_incremental = false;
+  opt_emit_pch = false;
+  stats_enabled = opt_stats_json = false;
+  opt_trace = NULL;
+  trace_enabled = false;
+  opt_j = 1;
+  max_errors = 1;
+
+  int argc = 0;
+  while (argv[argc])
+    argc++;
+
+  jmp_buf buf;
+  int status = setjmp(buf);
+  if (status == 0) {
+    exit_recover = &buf;
+    status = run(argc, argv);
+  } else {
+    status--;
+    discard_output();
+  }
+  exit_recover = NULL;
+  return status;
+}
+
+int main(int argc, char **argv) {
+  if (argc >= 3 && !strcmp(argv[1], "--client"))
+    return run_client(argv[2], argv + 3);
+
+  if (argc >= 3 && !strcmp(argv[1], "--server")) {
+    int nworkers = 1;
+    if (argc == 5 && !strcmp(argv[3], "-j"))
+      nworkers = atoi(argv[4]);
+    else if (argc != 3)
+      usage(1);
+    if (nworkers <= 0)
+      nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    run_server(argv[2], nworkers, serve_request);
+  }
 
-  // Traverse the AST to emit assembly.
-  FILE *out = open_file(opt_o);
-  codegen(prog, out);
-  return 0;
+  return run(argc, argv);
 }
@@ -10,8 +10,9 @@
 // multiple return values, the remaining tokens are returned to the
 // caller via a pointer argument.
 //
-// Input tokens are represented by a linked list. Unlike many recursive
-// descent parsers, we don't have the notion of the "input token stream".
+// Input tokens are represented by a contiguous array, so the token
+// after `tok` is `tok + 1`. Unlike many recursive descent parsers, we
+// don't have the notion of the "input token stream".
 // Most parsing functions don't change the global state of the parser.
 // So it is very easy to lookahead arbitrary number of tokens in this
 // parser.
@@ -19,29 +20,69 @@
 #include "chibicc.h"
 
 // Scope for local or global variables.
+//
+// All visible variables are kept in a single hash table keyed by their
+// interned names. A table slot points to the innermost declaration of
+// a name, which in turn points to the outer declaration it shadows.
 typedef struct VarScope VarScope;
 struct VarScope {
-  VarScope *next;
-  char *name;
+  VarScope *shadow; // Declaration of the same name in an outer scope
+  char *name;       // Interned, see intern()
   Obj *var;
 };
 
-// Represents a block scope.
-typedef struct Scope Scope;
-struct Scope {
-  Scope *next;
-  VarScope *vars;
-};
+typedef struct {
+  char *name;
+  VarScope *vs;
+} ScopeSlot;
+
+// Block scopes are represented by an undo log. Every declaration is
+// pushed to the log, and entering a block records the current length
+// of the log. Leaving the block pops the declarations made since then
+// and restores the names they shadowed, so the cost of a block is
+// proportional to the number of its own declarations rather than to
+// the nesting depth.
+typedef struct {
+  ScopeSlot *slots;
+  int capacity;
+  int used;
+
+  VarScope **log;
+  int log_len;
+  int log_capacity;
+
+  int *marks; // Log length at the start of each open block
+  int depth;
+  int marks_capacity;
+} Scope;
+
+// Parts of a declarator that are specific to a declaration rather
+// than to its type. Types are shared between declarations (see
+// struct Type), so they can't hold e.g. the declared name.
+typedef struct {
+  Token *name;         // Declared identifier
+  Token **param_names; // Parameter names if the type is a function
+} Decl;
 
 // All local variable instances created during parsing are
 // accumulated to this list.
 static Obj *locals;
 static Obj *globals;
 
-static Scope *scope = &(Scope){};
+int nr_expr_nodes;
+
+static Scope scope;
+
+// Function being parsed, or NULL at file scope
+static Obj *current_fn;
+
+// Numbers of the next anonymous global at file scope and in the
+// current function, see new_unique_name()
+static int unique_id;
+static int fn_unique_id;
 
 static Type *declspec(Token **rest, Token *tok);
-static Type *declarator(Token **rest, Token *tok, Type *ty);
+static Type *declarator(Token **rest, Token *tok, Type *ty, Decl *decl);
 static Node *declaration(Token **rest, Token *tok);
 static Node *compound_stmt(Token **rest, Token *tok);
 static Node *stmt(Token **rest, Token *tok);
@@ -56,27 +97,163 @@ static Node *postfix(Token **rest, Token *tok);
 static Node *unary(Token **rest, Token *tok);
 static Node *primary(Token **rest, Token *tok);
 
+// Returns a larger copy of an array that lives in a given arena.
+static void *grow_array(Arena *arena, void *old, int old_len, int new_len,
+                        int elem_size) {
+  void *arr = arena_alloc(arena, (size_t)new_len * elem_size);
+  if (old)
+    memcpy(arr, old, (size_t)old_len * elem_size);
+  return arr;
+}
+
+static int hash_ptr(void *p, int capacity) {
+  return (int)(((uintptr_t)p >> 4) * 0x9E3779B97F4A7C15ULL >> 32) & (capacity - 1);
+}
+
+// Returns the hash table slot for a given name, creating one if
+// the name hasn't been declared before.
+static ScopeSlot *get_slot(char *name) {
+  if (scope.used * 2 >= scope.capacity) {
+    ScopeSlot *old = scope.slots;
+    int old_capacity = scope.capacity;
+
+    scope.capacity = old_capacity ? old_capacity * 2 : 256;
+    scope.slots = arena_alloc(&scope_arena, scope.capacity * sizeof(ScopeSlot));
+
+    for (int i = 0; i < old_capacity; i++) {
+      if (!old[i].name)
+        continue;
+      int j = hash_ptr(old[i].name, scope.capacity);
+      while (scope.slots[j].name)
+        j = (j + 1) & (scope.capacity - 1);
+      scope.slots[j] = old[i];
+    }
+  }
+
+  int i = hash_ptr(name, scope.capacity);
+  for (; scope.slots[i].name; i = (i + 1) & (scope.capacity - 1))
+    if (scope.slots[i].name == name)
+      return &scope.slots[i];
+
+  scope.slots[i].name = name;
+  scope.used++;
+  return &scope.slots[i];
+}
+
 static void enter_scope(void) {
-  Scope *sc = calloc(1, sizeof(Scope));
-  sc->next = scope;
-  scope = sc;
+  if (scope.depth == scope.marks_capacity) {
+    int n = scope.marks_capacity ? scope.marks_capacity * 2 : 64;
+    scope.marks = grow_array(&scope_arena, scope.marks, scope.depth, n, sizeof(int));
+    scope.marks_capacity = n;
+  }
+  scope.marks[scope.depth++] = scope.log_len;
 }
 
 static void leave_scope(void) {
-  scope = scope->next;
+  int mark = scope.marks[--scope.depth];
+
+  while (scope.log_len > mark) {
+    VarScope *vs = scope.log[--scope.log_len];
+    get_slot(vs->name)->vs = vs->shadow;
+  }
+}
+
+// Records that the function being parsed refers to a global
+// variable, see hash_function().
+static void use_global(Obj *var) {
+  Obj *fn = current_fn;
+  for (int i = 0; i < fn->nr_globals_used; i++)
+    if (fn->globals_used[i] == var)
+      return;
+
+  int n = fn->nr_globals_used;
+  if ((n & (n - 1)) == 0)
+    fn->globals_used = grow_array(&node_arena, fn->globals_used, n,
+                                  n ? n * 2 : 4, sizeof(Obj *));
+  fn->globals_used[fn->nr_globals_used++] = var;
 }
 
-// Find a variable by name.
+// Find a variable by name. Names are interned, so comparing
+// pointers is enough.
 static Obj *find_var(Token *tok) {
-  for (Scope *sc = scope; sc; sc = sc->next)
-    for (VarScope *sc2 = sc->vars; sc2; sc2 = sc2->next)
-      if (equal(tok, sc2->name))
-        return sc2->var;
+  stats.find_var_calls++;
+  if (!scope.capacity)
+    return NULL;
+
+  int i = hash_ptr(tok->ident, scope.capacity);
+  for (; scope.slots[i].name; i = (i + 1) & (scope.capacity - 1)) {
+    stats.find_var_probes++;
+    if (scope.slots[i].name == tok->ident) {
+      VarScope *vs = scope.slots[i].vs;
+      if (!vs)
+        return NULL;
+      if (!vs->var->is_local && current_fn)
+        use_global(vs->var);
+      return vs->var;
+    }
+  }
   return NULL;
 }
 
+#define NODE_SIZE(member) (offsetof(Node, member) + sizeof(((Node *)0)->member))
+
+// Returns the number of bytes a node of a given kind needs.
+static size_t node_size(NodeKind kind) {
+  switch (kind) {
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+  case ND_ASSIGN:
+    return NODE_SIZE(rhs);
+  case ND_NEG:
+  case ND_ADDR:
+  case ND_DEREF:
+  case ND_RETURN:
+  case ND_EXPR_STMT:
+    return NODE_SIZE(lhs);
+  case ND_IF:
+  case ND_FOR:
+    return NODE_SIZE(inc);
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    return NODE_SIZE(body);
+  case ND_FUNCALL:
+    return NODE_SIZE(args);
+  case ND_VAR:
+    return NODE_SIZE(var);
+  case ND_NUM:
+    return NODE_SIZE(val);
+  }
+  unreachable();
+}
+
+// Returns true if a given node kind is a statement. Statements don't
+// have a type.
+static bool is_stmt_kind(NodeKind kind) {
+  switch (kind) {
+  case ND_RETURN:
+  case ND_IF:
+  case ND_FOR:
+  case ND_BLOCK:
+  case ND_EXPR_STMT:
+    return true;
+  }
+  return false;
+}
+
+// Creates a node. An expression node must be passed to add_type()
+// once its operands are set; the new_binary() family does this.
 static Node *new_node(NodeKind kind, Token *tok) {
-  Node *node = calloc(1, sizeof(Node));
+  if (!is_stmt_kind(kind))
+    nr_expr_nodes++;
+
+  stats.nodes++;
+  Node *node = arena_alloc(&node_arena, node_size(kind));
   node->kind = kind;
   node->tok = tok;
   return node;
@@ -86,38 +263,52 @@ static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Token *tok) {
   Node *node = new_node(kind, tok);
   node->lhs = lhs;
   node->rhs = rhs;
+  add_type(node);
   return node;
 }
 
 static Node *new_unary(NodeKind kind, Node *expr, Token *tok) {
   Node *node = new_node(kind, tok);
   node->lhs = expr;
+  add_type(node);
   return node;
 }
 
 static Node *new_num(int val, Token *tok) {
   Node *node = new_node(ND_NUM, tok);
   node->val = val;
+  add_type(node);
   return node;
 }
 
 static Node *new_var_node(Obj *var, Token *tok) {
   Node *node = new_node(ND_VAR, tok);
   node->var = var;
+  add_type(node);
   return node;
 }
 
 static VarScope *push_scope(char *name, Obj *var) {
-  VarScope *sc = calloc(1, sizeof(VarScope));
+  VarScope *sc = arena_alloc(&scope_arena, sizeof(VarScope));
   sc->name = name;
   sc->var = var;
-  sc->next = scope->vars;
-  scope->vars = sc;
+
+  ScopeSlot *slot = get_slot(name);
+  sc->shadow = slot->vs;
+  slot->vs = sc;
+
+  if (scope.log_len == scope.log_capacity) {
+    int n = scope.log_capacity ? scope.log_capacity * 2 : 256;
+    scope.log = grow_array(&scope_arena, scope.log, scope.log_len, n, sizeof(VarScope *));
+    scope.log_capacity = n;
+  }
+  scope.log[scope.log_len++] = sc;
   return sc;
 }
 
 static Obj *new_var(char *name, Type *ty) {
-  Obj *var = calloc(1, sizeof(Obj));
+  stats.objs++;
+  Obj *var = arena_alloc(&node_arena, sizeof(Obj));
   var->name = name;
   var->ty = ty;
   push_scope(name, var);
@@ -139,9 +330,13 @@ static Obj *new_gvar(char *name, Type *ty) {
   return var;
 }
 
+// Anonymous globals in a function are numbered per function, so
+// that the code generated for a function doesn't depend on how many
+// string literals the functions before it have. See hash_function().
 static char *new_unique_name(void) {
-  static int id = 0;
-  return format(".L..%d", id++);
+  if (current_fn)
+    return format(".L..%s.%d", current_fn->name, fn_unique_id++);
+  return format(".L..%d", unique_id++);
 }
 
 static Obj *new_anon_gvar(Type *ty) {
@@ -157,7 +352,7 @@ static Obj *new_string_literal(char *p, Type *ty) {
 static char *get_ident(Token *tok) {
   if (tok->kind != TK_IDENT)
     error_tok(tok, "expected an identifier");
-  return strndup(tok->loc, tok->len);
+  return tok->ident;
 }
 
 static int get_number(Token *tok) {
@@ -168,8 +363,8 @@ static int get_number(Token *tok) {
 
 // declspec = "char" | "int"
 static Type *declspec(Token **rest, Token *tok) {
-  if (equal(tok, "char")) {
-    *rest = tok->next;
+  if (tok->id == KW_CHAR) {
+    *rest = tok + 1;
     return ty_char;
   }
 
@@ -179,35 +374,45 @@ static Type *declspec(Token **rest, Token *tok) {
 
 // func-params = (param ("," param)*)? ")"
 // param       = declspec declarator
-static Type *func_params(Token **rest, Token *tok, Type *ty) {
-  Type head = {};
-  Type *cur = &head;
-
-  while (!equal(tok, ")")) {
-    if (cur != &head)
+static Type *func_params(Token **rest, Token *tok, Type *ty, Decl *decl) {
+  Type **params = NULL;
+  Token **names = NULL;
+  int nparams = 0;
+  int capacity = 0;
+
+  while (tok->id != ')') {
+    if (nparams > 0)
       tok = skip(tok, ",");
+
+    if (nparams == capacity) {
+      int n = capacity ? capacity * 2 : 8;
+      params = grow_array(&node_arena, params, nparams, n, sizeof(Type *));
+      names = grow_array(&node_arena, names, nparams, n, sizeof(Token *));
+      capacity = n;
+    }
+
+    Decl param = {};
     Type *basety = declspec(&tok, tok);
-    Type *ty = declarator(&tok, tok, basety);
-    cur = cur->next = copy_type(ty);
+    params[nparams] = declarator(&tok, tok, basety, &param);
+    names[nparams++] = param.name;
   }
 
-  ty = func_type(ty);
-  ty->params = head.next;
-  *rest = tok->next;
-  return ty;
+  decl->param_names = names;
+  *rest = tok + 1;
+  return func_type(ty, params, nparams);
 }
 
 // type-suffix = "(" func-params
 //             | "[" num "]" type-suffix
 //             | ε
-static Type *type_suffix(Token **rest, Token *tok, Type *ty) {
-  if (equal(tok, "("))
-    return func_params(rest, tok->next, ty);
-
-  if (equal(tok, "[")) {
-    int sz = get_number(tok->next);
-    tok = skip(tok->next->next, "]");
-    ty = type_suffix(rest, tok, ty);
+static Type *type_suffix(Token **rest, Token *tok, Type *ty, Decl *decl) {
+  if (tok->id == '(')
+    return func_params(rest, tok + 1, ty, decl);
+
+  if (tok->id == '[') {
+    int sz = get_number(tok + 1);
+    tok = skip(tok + 2, "]");
+    ty = type_suffix(rest, tok, ty, decl);
     return array_of(ty, sz);
   }
 
@@ -216,15 +421,17 @@ static Type *type_suffix(Token **rest, Token *tok, Type *ty) {
 }
 
 // declarator = "*"* ident type-suffix
-static Type *declarator(Token **rest, Token *tok, Type *ty) {
-  while (consume(&tok, tok, "*"))
+//
+// Returns the declared type. The name and other declaration-specific
+// information are returned via `decl`.
+static Type *declarator(Token **rest, Token *tok, Type *ty, Decl *decl) {
+  for (; tok->id == '*'; tok++)
     ty = pointer_to(ty);
 
   if (tok->kind != TK_IDENT)
     error_tok(tok, "expected a variable name");
-  ty = type_suffix(rest, tok->next, ty);
-  ty->name = tok;
-  return ty;
+  decl->name = tok;
+  return type_suffix(rest, tok + 1, ty, decl);
 }
 
 // declaration = declspec (declarator ("=" expr)? ("," declarator ("=" expr)?)*)? ";"
@@ -235,31 +442,63 @@ static Node *declaration(Token **rest, Token *tok) {
   Node *cur = &head;
   int i = 0;
 
-  while (!equal(tok, ";")) {
+  while (tok->id != ';') {
     if (i++ > 0)
       tok = skip(tok, ",");
 
-    Type *ty = declarator(&tok, tok, basety);
-    Obj *var = new_lvar(get_ident(ty->name), ty);
+    Decl decl = {};
+    Type *ty = declarator(&tok, tok, basety, &decl);
+    Obj *var = new_lvar(get_ident(decl.name), ty);
 
-    if (!equal(tok, "="))
+    if (tok->id != '=')
       continue;
 
-    Node *lhs = new_var_node(var, ty->name);
-    Node *rhs = assign(&tok, tok->next);
-    Node *node = new_binary(ND_ASSIGN, lhs, rhs, tok);
-    cur = cur->next = new_unary(ND_EXPR_STMT, node, tok);
+    Node *lhs = new_var_node(var, decl.name);
+    Node *rhs = assign(&tok, tok + 1);
+    cur = cur->next = new_node(ND_EXPR_STMT, tok);
+    cur->lhs = new_binary(ND_ASSIGN, lhs, rhs, tok);
   }
 
   Node *node = new_node(ND_BLOCK, tok);
   node->body = head.next;
-  *rest = tok->next;
+  *rest = tok + 1;
   return node;
 }
 
+// Returns the token following a statement or a top-level declaration
+// that contains an error, so that parsing can resume there. Braces
+// are balanced so that a block belonging to the statement is skipped
+// as a whole, while a '}' that closes the enclosing block is not
+// consumed.
+static Token *sync(Token *start) {
+  Token *tok = start;
+  int depth = 0;
+
+  if (error_token && error_token > start) {
+    for (; tok < error_token; tok++)
+      depth += (tok->id == '{') - (tok->id == '}');
+    if (depth < 0)
+      depth = 0;
+  }
+
+  for (; tok->kind != TK_EOF; tok++) {
+    if (tok->id == '{') {
+      depth++;
+    } else if (tok->id == '}') {
+      if (depth == 0)
+        return (tok == start) ? tok + 1 : tok;
+      if (--depth == 0)
+        return tok + 1;
+    } else if (tok->id == ';' && depth == 0) {
+      return tok + 1;
+    }
+  }
+  return tok;
+}
+
 // Returns true if a given token represents a type.
 static bool is_typename(Token *tok) {
-  return equal(tok, "char") || equal(tok, "int");
+  return tok->id == KW_CHAR || tok->id == KW_INT;
 }
 
 // stmt = "return" expr ";"
@@ -269,54 +508,52 @@ static bool is_typename(Token *tok) {
 //      | "{" compound-stmt
 //      | expr-stmt
 static Node *stmt(Token **rest, Token *tok) {
-  if (equal(tok, "return")) {
+  switch (tok->id) {
+  case KW_RETURN: {
     Node *node = new_node(ND_RETURN, tok);
-    node->lhs = expr(&tok, tok->next);
+    node->lhs = expr(&tok, tok + 1);
     *rest = skip(tok, ";");
     return node;
   }
-
-  if (equal(tok, "if")) {
+  case KW_IF: {
     Node *node = new_node(ND_IF, tok);
-    tok = skip(tok->next, "(");
+    tok = skip(tok + 1, "(");
     node->cond = expr(&tok, tok);
     tok = skip(tok, ")");
     node->then = stmt(&tok, tok);
-    if (equal(tok, "else"))
-      node->els = stmt(&tok, tok->next);
+    if (tok->id == KW_ELSE)
+      node->els = stmt(&tok, tok + 1);
     *rest = tok;
     return node;
   }
-
-  if (equal(tok, "for")) {
+  case KW_FOR: {
     Node *node = new_node(ND_FOR, tok);
-    tok = skip(tok->next, "(");
+    tok = skip(tok + 1, "(");
 
     node->init = expr_stmt(&tok, tok);
 
-    if (!equal(tok, ";"))
+    if (tok->id != ';')
       node->cond = expr(&tok, tok);
     tok = skip(tok, ";");
 
-    if (!equal(tok, ")"))
+    if (tok->id != ')')
       node->inc = expr(&tok, tok);
     tok = skip(tok, ")");
 
     node->then = stmt(rest, tok);
     return node;
   }
-
-  if (equal(tok, "while")) {
+  case KW_WHILE: {
     Node *node = new_node(ND_FOR, tok);
-    tok = skip(tok->next, "(");
+    tok = skip(tok + 1, "(");
     node->cond = expr(&tok, tok);
     tok = skip(tok, ")");
     node->then = stmt(rest, tok);
     return node;
   }
-
-  if (equal(tok, "{"))
-    return compound_stmt(rest, tok->next);
+  case '{':
+    return compound_stmt(rest, tok + 1);
+  }
 
   return expr_stmt(rest, tok);
 }
@@ -329,25 +566,44 @@ static Node *compound_stmt(Token **rest, Token *tok) {
 
   enter_scope();
 
-  while (!equal(tok, "}")) {
+  while (tok->id != '}') {
+    Token *start = tok;
+    jmp_buf buf;
+    jmp_buf *outer = error_recover;
+    int scope_depth = scope.depth;
+
+    // Skip a statement with an error and go on to the next one.
+    if (max_errors != 1) {
+      if (setjmp(buf)) {
+        error_recover = outer;
+        tok = sync(start);
+        if (tok->kind == TK_EOF)
+          longjmp(*outer, 1);
+        while (scope.depth > scope_depth)
+          leave_scope();
+        continue;
+      }
+      error_recover = &buf;
+    }
+
     if (is_typename(tok))
       cur = cur->next = declaration(&tok, tok);
     else
       cur = cur->next = stmt(&tok, tok);
-    add_type(cur);
+    error_recover = outer;
   }
 
   leave_scope();
 
   node->body = head.next;
-  *rest = tok->next;
+  *rest = tok + 1;
   return node;
 }
 
 // expr-stmt = expr? ";"
 static Node *expr_stmt(Token **rest, Token *tok) {
-  if (equal(tok, ";")) {
-    *rest = tok->next;
+  if (tok->id == ';') {
+    *rest = tok + 1;
     return new_node(ND_BLOCK, tok);
   }
 
@@ -366,8 +622,8 @@ static Node *expr(Token **rest, Token *tok) {
 static Node *assign(Token **rest, Token *tok) {
   Node *node = equality(&tok, tok);
 
-  if (equal(tok, "="))
-    return new_binary(ND_ASSIGN, node, assign(rest, tok->next), tok);
+  if (tok->id == '=')
+    return new_binary(ND_ASSIGN, node, assign(rest, tok + 1), tok);
 
   *rest = tok;
   return node;
@@ -380,13 +636,12 @@ static Node *equality(Token **rest, Token *tok) {
   for (;;) {
     Token *start = tok;
 
-    if (equal(tok, "==")) {
-      node = new_binary(ND_EQ, node, relational(&tok, tok->next), start);
+    switch (tok->id) {
+    case PU_EQ:
+      node = new_binary(ND_EQ, node, relational(&tok, tok + 1), start);
       continue;
-    }
-
-    if (equal(tok, "!=")) {
-      node = new_binary(ND_NE, node, relational(&tok, tok->next), start);
+    case PU_NE:
+      node = new_binary(ND_NE, node, relational(&tok, tok + 1), start);
       continue;
     }
 
@@ -402,23 +657,18 @@ static Node *relational(Token **rest, Token *tok) {
   for (;;) {
     Token *start = tok;
 
-    if (equal(tok, "<")) {
-      node = new_binary(ND_LT, node, add(&tok, tok->next), start);
+    switch (tok->id) {
+    case '<':
+      node = new_binary(ND_LT, node, add(&tok, tok + 1), start);
       continue;
-    }
-
-    if (equal(tok, "<=")) {
-      node = new_binary(ND_LE, node, add(&tok, tok->next), start);
+    case PU_LE:
+      node = new_binary(ND_LE, node, add(&tok, tok + 1), start);
       continue;
-    }
-
-    if (equal(tok, ">")) {
-      node = new_binary(ND_LT, add(&tok, tok->next), node, start);
+    case '>':
+      node = new_binary(ND_LT, add(&tok, tok + 1), node, start);
       continue;
-    }
-
-    if (equal(tok, ">=")) {
-      node = new_binary(ND_LE, add(&tok, tok->next), node, start);
+    case PU_GE:
+      node = new_binary(ND_LE, add(&tok, tok + 1), node, start);
       continue;
     }
 
@@ -433,9 +683,6 @@ static Node *relational(Token **rest, Token *tok) {
 // In other words, we need to scale an integer value before adding to a
 // pointer value. This function takes care of the scaling.
 static Node *new_add(Node *lhs, Node *rhs, Token *tok) {
-  add_type(lhs);
-  add_type(rhs);
-
   // num + num
   if (is_integer(lhs->ty) && is_integer(rhs->ty))
     return new_binary(ND_ADD, lhs, rhs, tok);
@@ -457,9 +704,6 @@ static Node *new_add(Node *lhs, Node *rhs, Token *tok) {
 
 // Like `+`, `-` is overloaded for the pointer type.
 static Node *new_sub(Node *lhs, Node *rhs, Token *tok) {
-  add_type(lhs);
-  add_type(rhs);
-
   // num - num
   if (is_integer(lhs->ty) && is_integer(rhs->ty))
     return new_binary(ND_SUB, lhs, rhs, tok);
@@ -467,10 +711,7 @@ static Node *new_sub(Node *lhs, Node *rhs, Token *tok) {
   // ptr - num
   if (lhs->ty->base && is_integer(rhs->ty)) {
     rhs = new_binary(ND_MUL, rhs, new_num(lhs->ty->base->size, tok), tok);
-    add_type(rhs);
-    Node *node = new_binary(ND_SUB, lhs, rhs, tok);
-    node->ty = lhs->ty;
-    return node;
+    return new_binary(ND_SUB, lhs, rhs, tok);
   }
 
   // ptr - ptr, which returns how many elements are between the two.
@@ -490,13 +731,12 @@ static Node *add(Token **rest, Token *tok) {
   for (;;) {
     Token *start = tok;
 
-    if (equal(tok, "+")) {
-      node = new_add(node, mul(&tok, tok->next), start);
+    switch (tok->id) {
+    case '+':
+      node = new_add(node, mul(&tok, tok + 1), start);
       continue;
-    }
-
-    if (equal(tok, "-")) {
-      node = new_sub(node, mul(&tok, tok->next), start);
+    case '-':
+      node = new_sub(node, mul(&tok, tok + 1), start);
       continue;
     }
 
@@ -512,13 +752,12 @@ static Node *mul(Token **rest, Token *tok) {
   for (;;) {
     Token *start = tok;
 
-    if (equal(tok, "*")) {
-      node = new_binary(ND_MUL, node, unary(&tok, tok->next), start);
+    switch (tok->id) {
+    case '*':
+      node = new_binary(ND_MUL, node, unary(&tok, tok + 1), start);
       continue;
-    }
-
-    if (equal(tok, "/")) {
-      node = new_binary(ND_DIV, node, unary(&tok, tok->next), start);
+    case '/':
+      node = new_binary(ND_DIV, node, unary(&tok, tok + 1), start);
       continue;
     }
 
@@ -530,17 +769,16 @@ static Node *mul(Token **rest, Token *tok) {
 // unary = ("+" | "-" | "*" | "&") unary
 //       | postfix
 static Node *unary(Token **rest, Token *tok) {
-  if (equal(tok, "+"))
-    return unary(rest, tok->next);
-
-  if (equal(tok, "-"))
-    return new_unary(ND_NEG, unary(rest, tok->next), tok);
-
-  if (equal(tok, "&"))
-    return new_unary(ND_ADDR, unary(rest, tok->next), tok);
-
-  if (equal(tok, "*"))
-    return new_unary(ND_DEREF, unary(rest, tok->next), tok);
+  switch (tok->id) {
+  case '+':
+    return unary(rest, tok + 1);
+  case '-':
+    return new_unary(ND_NEG, unary(rest, tok + 1), tok);
+  case '&':
+    return new_unary(ND_ADDR, unary(rest, tok + 1), tok);
+  case '*':
+    return new_unary(ND_DEREF, unary(rest, tok + 1), tok);
+  }
 
   return postfix(rest, tok);
 }
@@ -549,10 +787,10 @@ static Node *unary(Token **rest, Token *tok) {
 static Node *postfix(Token **rest, Token *tok) {
   Node *node = primary(&tok, tok);
 
-  while (equal(tok, "[")) {
+  while (tok->id == '[') {
     // x[y] is short for *(x+y)
     Token *start = tok;
-    Node *idx = expr(&tok, tok->next);
+    Node *idx = expr(&tok, tok + 1);
     tok = skip(tok, "]");
     node = new_unary(ND_DEREF, new_add(node, idx, start), start);
   }
@@ -563,12 +801,12 @@ static Node *postfix(Token **rest, Token *tok) {
 // funcall = ident "(" (assign ("," assign)*)? ")"
 static Node *funcall(Token **rest, Token *tok) {
   Token *start = tok;
-  tok = tok->next->next;
+  tok = tok + 2;
 
   Node head = {};
   Node *cur = &head;
 
-  while (!equal(tok, ")")) {
+  while (tok->id != ')') {
     if (cur != &head)
       tok = skip(tok, ",");
     cur = cur->next = assign(&tok, tok);
@@ -577,8 +815,9 @@ static Node *funcall(Token **rest, Token *tok) {
   *rest = skip(tok, ")");
 
   Node *node = new_node(ND_FUNCALL, start);
-  node->funcname = strndup(start->loc, start->len);
+  node->funcname = start->ident;
   node->args = head.next;
+  add_type(node);
   return node;
 }
 
@@ -589,122 +828,182 @@ static Node *funcall(Token **rest, Token *tok) {
 //         | str
 //         | num
 static Node *primary(Token **rest, Token *tok) {
-  if (equal(tok, "(") && equal(tok->next, "{")) {
+  if (tok->id == '(' && tok[1].id == '{') {
     // This is a GNU statement expresssion.
     // used in testing like 
     // ASSERT(1, ({int a; a = 1; return a})) 
     Node *node = new_node(ND_STMT_EXPR, tok);
-    node->body = compound_stmt(&tok, tok->next->next)->body;
+    node->body = compound_stmt(&tok, tok + 2)->body;
     *rest = skip(tok, ")");
+    add_type(node);
     return node;
   }
 
-  if (equal(tok, "(")) {
-    Node *node = expr(&tok, tok->next);
+  if (tok->id == '(') {
+    Node *node = expr(&tok, tok + 1);
     *rest = skip(tok, ")");
     return node;
   }
 
-  if (equal(tok, "sizeof")) {
-    Node *node = unary(rest, tok->next);
-    add_type(node);
+  if (tok->id == KW_SIZEOF) {
+    Node *node = unary(rest, tok + 1);
     return new_num(node->ty->size, tok);
   }
 
   if (tok->kind == TK_IDENT) {
     // Function call
-    if (equal(tok->next, "("))
+    if (tok[1].id == '(')
       return funcall(rest, tok);
 
     // Variable
     Obj *var = find_var(tok);
     if (!var)
       error_tok(tok, "undefined variable");
-    *rest = tok->next;
+    *rest = tok + 1;
     return new_var_node(var, tok);
   }
 
   if (tok->kind == TK_STR) {
-    Obj *var = new_string_literal(tok->str, tok->ty);
-    *rest = tok->next;
+    StrLit *lit = str_literal(tok);
+    Obj *var = new_string_literal(lit->str, array_of(ty_char, lit->len));
+    *rest = tok + 1;
     return new_var_node(var, tok);
   }
 
   if (tok->kind == TK_NUM) {
     Node *node = new_num(tok->val, tok);
-    *rest = tok->next;
+    *rest = tok + 1;
     return node;
   }
 
   error_tok(tok, "expected an expression");
 }
 
-static void create_param_lvars(Type *param) {
-  if (param) {
-    create_param_lvars(param->next);
-    new_lvar(get_ident(param->name), param);
-  }
+// Creates local variables for function parameters. They are created
+// in reverse order so that the resulting list is in declaration order.
+static void create_param_lvars(Type *ty, Decl *decl) {
+  for (int i = ty->nparams - 1; i >= 0; i--)
+    new_lvar(get_ident(decl->param_names[i]), ty->params[i]);
 }
 
-static Token *function(Token *tok, Type *basety) {
-  Type *ty = declarator(&tok, tok, basety);
-
-  Obj *fn = new_gvar(get_ident(ty->name), ty);
+// function-definition = declspec declarator "{" compound-stmt
+//
+// The declspec and the declarator have already been read by parse(),
+// starting at `start`.
+static Token *function(Token *tok, Token *start, Type *ty, Decl *decl) {
+  double ts = trace_enabled ? trace_now() : 0;
+  Obj *fn = new_gvar(get_ident(decl->name), ty);
   fn->is_function = true;
+  fn->tok = start;
+  current_fn = fn;
+  fn_unique_id = 0;
 
   locals = NULL;
   enter_scope();
-  create_param_lvars(ty->params);
+  create_param_lvars(ty, decl);
   fn->params = locals;
 
   tok = skip(tok, "{");
   fn->body = compound_stmt(&tok, tok);
   fn->locals = locals;
+  fn->end = tok;
   leave_scope();
+  current_fn = NULL;
+
+  if (trace_enabled)
+    trace_event("parse", fn->name, ts);
   return tok;
 }
 
-static Token *global_variable(Token *tok, Type *basety) {
-  bool first = true;
+// global-variable = declspec (declarator ("," declarator)*)? ";"
+//
+// The declspec and the first declarator have already been read by
+// parse().
+static Token *global_variable(Token *tok, Type *basety, Type *ty, Decl *decl) {
+  new_gvar(get_ident(decl->name), ty);
 
   while (!consume(&tok, tok, ";")) {
-    if (!first)
-      tok = skip(tok, ",");
-    first = false;
+    tok = skip(tok, ",");
 
-    Type *ty = declarator(&tok, tok, basety);
-    new_gvar(get_ident(ty->name), ty);
+    Decl decl = {};
+    Type *ty = declarator(&tok, tok, basety, &decl);
+    new_gvar(get_ident(decl.name), ty);
   }
   return tok;
 }
 
-// Lookahead tokens and returns true if a given token is a start
-// of a function definition or declaration.
-static bool is_function(Token *tok) {
-  if (equal(tok, ";"))
-    return false;
-
-  Type dummy = {};
-  Type *ty = declarator(&tok, tok, &dummy);
-  return ty->kind == TY_FUNC;
+// Declares the global variables of a precompiled header, which are
+// in declaration order, as if they had been parsed.
+void declare_globals(Obj *vars) {
+  while (vars) {
+    Obj *var = vars;
+    vars = vars->next;
+    push_scope(var->name, var);
+    var->next = globals;
+    globals = var;
+
+    // Anonymous globals of the file must not reuse the header's names.
+    int n;
+    if (sscanf(var->name, ".L..%d", &n) == 1 && unique_id <= n)
+      unique_id = n + 1;
+  }
 }
 
 // program = (function-definition | global-variable)*
 Obj *parse(Token *tok) {
-  globals = NULL;
+  phase_begin(PH_PARSE);
 
   while (tok->kind != TK_EOF) {
+    Token *start = tok;
+    jmp_buf buf;
+
+    // Skip a declaration with an error and go on to the next one.
+    if (max_errors != 1) {
+      if (setjmp(buf)) {
+        tok = sync(start);
+        while (scope.depth > 0)
+          leave_scope();
+        continue;
+      }
+      error_recover = &buf;
+    }
+
     Type *basety = declspec(&tok, tok);
 
+    // A declaration that declares nothing, e.g. "int;"
+    if (tok->id == ';') {
+      tok++;
+      continue;
+    }
+
+    // Whether this is a function or a global variable is known only
+    // after reading the first declarator, so read it once here and
+    // hand it over instead of looking ahead and parsing it twice.
+    Decl decl = {};
+    Type *ty = declarator(&tok, tok, basety, &decl);
+
     // Function
-    if (is_function(tok)) {
-      tok = function(tok, basety);
+    if (ty->kind == TY_FUNC) {
+      tok = function(tok, start, ty, &decl);
       continue;
     }
 
     // Global variable
-    tok = global_variable(tok, basety);
-
+    tok = global_variable(tok, basety, ty, &decl);
   }
+
+  error_recover = NULL;
+  phase_end(PH_PARSE);
   return globals;
 }
+
+// Forgets the globals and scopes of the previous compilation. They
+// live in node_arena and scope_arena, which are reset along with this.
+void reset_parser(void) {
+  locals = NULL;
+  globals = NULL;
+  scope = (Scope){0};
+  current_fn = NULL;
+  unique_id = fn_unique_id = 0;
+  nr_expr_nodes = 0;
+}
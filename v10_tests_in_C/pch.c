@@ -0,0 +1,396 @@
+// This file contains precompiled headers.
+//
+// `chibicc --emit-pch foo.h` preprocesses and parses a header and
+// writes the result to foo.h.pch: the macros defined at the end of the
+// header, and the global variables it declares along with their types.
+// When a file's first #include names foo.h and foo.h.pch is up to
+// date, the preprocessor loads foo.h.pch instead of reading foo.h
+// (see include_pch()). Nothing is tokenized or parsed, and the file is
+// only a few kilobytes.
+//
+// The file contains no pointers; everything refers to other parts of
+// the file by offset or index, so it is mapped into memory and read in
+// place. Types are stored as an array in which a type comes after its
+// components, so they can be rebuilt in one pass with the usual
+// hash-consing constructors.
+//
+// A precompiled header is valid only if
+//
+//  - it was written by the same compiler executable,
+//  - the include paths and the macros defined before the header was
+//    included are the same as when it was written, and
+//  - the header and the files it included have the same size and
+//    mtime as when it was written.
+//
+// A header that defines functions cannot be precompiled.
+
+#define _DEFAULT_SOURCE
+#include "chibicc.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PCH_MAGIC "chibpch1"
+
+typedef struct {
+  char magic[8];
+  uint8_t compiler[32]; // Hash of the compiler's identity
+  uint32_t env;         // Offset of the environment, see preprocessor_env()
+  uint32_t macros;      // Offset of the macro definitions
+  uint32_t deps;        // Offset of the PchDep array
+  uint32_t ndeps;
+  uint32_t types;       // Offset of the PchType array
+  uint32_t ntypes;
+  uint32_t vars;        // Offset of the PchVar array
+  uint32_t nvars;
+} PchHeader;
+
+// A file that the header was made from
+typedef struct {
+  uint32_t path; // Offset of the '\0'-terminated path
+  int64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+} PchDep;
+
+// A type. Types are referred to by index plus 1, with 0 for NULL.
+typedef struct {
+  uint32_t kind;
+  int32_t size;
+  uint32_t base;
+  int32_t array_len;
+  uint32_t return_ty;
+  uint32_t params;  // Offset of a uint32_t array of type references
+  uint32_t nparams;
+} PchType;
+
+// A global variable, in declaration order
+typedef struct {
+  uint32_t name;      // Offset of the '\0'-terminated name
+  uint32_t ty;        // Type reference
+  uint32_t init_data; // Offset of ty->size bytes, or 0 if none
+} PchVar;
+
+static void get_compiler_id(uint8_t id[32]) {
+  Sha256 ctx;
+  sha256_init(&ctx);
+  hash_compiler(&ctx);
+  sha256_final(&ctx, id);
+}
+
+//
+// Writer
+//
+
+// The file is built in memory and written at once.
+static char *buf;
+static size_t buf_len;
+static size_t buf_capacity;
+
+static uint32_t append(void *p, size_t len) {
+  if (buf_len + len > buf_capacity) {
+    buf_capacity = (buf_len + len) * 2;
+    buf = realloc(buf, buf_capacity);
+  }
+  uint32_t off = buf_len;
+  memcpy(buf + buf_len, p, len);
+  buf_len += len;
+  return off;
+}
+
+static uint32_t append_str(char *s) {
+  return append(s, strlen(s) + 1);
+}
+
+// Types written so far, in the order of the PchType array
+static Type **types;
+static int ntypes;
+
+// Returns the reference to a type, adding it and its components to
+// the type list if needed.
+static uint32_t add_type_ref(Type *ty) {
+  if (!ty)
+    return 0;
+
+  for (int i = 0; i < ntypes; i++)
+    if (types[i] == ty)
+      return i + 1;
+
+  add_type_ref(ty->base);
+  add_type_ref(ty->return_ty);
+  for (int i = 0; i < ty->nparams; i++)
+    add_type_ref(ty->params[i]);
+
+  types = realloc(types, (ntypes + 1) * sizeof(Type *));
+  types[ntypes++] = ty;
+  return ntypes;
+}
+
+// Writes a precompiled header for the file that has been preprocessed
+// and parsed into `prog`. `env` is what preprocessor_env() returned
+// before the header was preprocessed.
+void write_pch(char *path, char *env, Obj *prog) {
+  buf_len = 0;
+  ntypes = 0;
+
+  PchHeader hdr = {PCH_MAGIC};
+  append(&hdr, sizeof(hdr));
+  get_compiler_id(hdr.compiler);
+  hdr.env = append_str(env);
+
+  char *macros = macro_definitions();
+  hdr.macros = append_str(macros);
+  free(macros);
+
+  // Files the header was made from
+  int nfiles;
+  File **files = get_input_files(&nfiles);
+  PchDep *deps = calloc(nfiles, sizeof(PchDep));
+
+  for (int i = 0; i < nfiles; i++) {
+    if (!files[i]->owns_contents)
+      continue;
+
+    struct stat st;
+    if (stat(files[i]->name, &st) != 0)
+      error("%s: %s", files[i]->name, strerror(errno));
+    deps[hdr.ndeps++] = (PchDep){
+      append_str(files[i]->name), st.st_size,
+      st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+    };
+  }
+  hdr.deps = append(deps, hdr.ndeps * sizeof(PchDep));
+  free(deps);
+
+  // `prog` is in reverse declaration order.
+  for (Obj *var = prog; var; var = var->next) {
+    if (var->is_function)
+      error("%s: cannot precompile a header that defines a function: %s",
+            path, var->name);
+    hdr.nvars++;
+  }
+
+  PchVar *vars = calloc(hdr.nvars, sizeof(PchVar));
+  int i = hdr.nvars;
+  for (Obj *var = prog; var; var = var->next) {
+    PchVar *v = &vars[--i];
+    v->name = append_str(var->name);
+    v->ty = add_type_ref(var->ty);
+    if (var->init_data)
+      v->init_data = append(var->init_data, var->ty->size);
+  }
+  hdr.vars = append(vars, hdr.nvars * sizeof(PchVar));
+  free(vars);
+
+  PchType *arr = calloc(ntypes, sizeof(PchType));
+  for (int i = 0; i < ntypes; i++) {
+    Type *ty = types[i];
+    uint32_t *params = calloc(ty->nparams + 1, sizeof(uint32_t));
+    for (int j = 0; j < ty->nparams; j++)
+      params[j] = add_type_ref(ty->params[j]);
+
+    arr[i] = (PchType){
+      ty->kind, ty->size, add_type_ref(ty->base), ty->array_len,
+      add_type_ref(ty->return_ty),
+      append(params, ty->nparams * sizeof(uint32_t)), ty->nparams,
+    };
+    free(params);
+  }
+  hdr.types = append(arr, ntypes * sizeof(PchType));
+  hdr.ntypes = ntypes;
+  free(arr);
+
+  memcpy(buf, &hdr, sizeof(hdr));
+
+  // Write to a temporary file first so that a compiler running
+  // at the same time never sees a partial file.
+  char *tmp = format("%s.XXXXXX", path);
+  int fd = mkstemp(tmp);
+  if (fd == -1)
+    error("cannot open output file: %s: %s", path, strerror(errno));
+  fchmod(fd, 0644);
+
+  for (size_t off = 0; off < buf_len;) {
+    ssize_t n = write(fd, buf + off, buf_len - off);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      unlink(tmp);
+      error("%s: write failed: %s", tmp, strerror(errno));
+    }
+    off += n;
+  }
+  close(fd);
+
+  if (rename(tmp, path) != 0) {
+    unlink(tmp);
+    error("cannot rename %s to %s: %s", tmp, path, strerror(errno));
+  }
+  free(tmp);
+}
+
+//
+// Reader
+//
+
+// Returns true if the array of `n` elements of `size` bytes at `off`
+// lies within a file of `len` bytes.
+static bool in_file(size_t len, uint32_t off, uint64_t n, size_t size) {
+  return off <= len && n * size <= len - off;
+}
+
+static bool valid_str(char *p, size_t len, uint32_t off) {
+  return off < len && memchr(p + off, '\0', len - off);
+}
+
+static bool deps_unchanged(char *p, size_t len, PchHeader *hdr) {
+  PchDep *deps = (PchDep *)(p + hdr->deps);
+
+  for (int i = 0; i < hdr->ndeps; i++) {
+    if (!valid_str(p, len, deps[i].path))
+      return false;
+
+    struct stat st;
+    if (stat(p + deps[i].path, &st) != 0 || st.st_size != deps[i].size ||
+        st.st_mtim.tv_sec != deps[i].mtime_sec ||
+        st.st_mtim.tv_nsec != deps[i].mtime_nsec)
+      return false;
+  }
+  return true;
+}
+
+// Rebuilds the types in a PCH. Returns NULL if the file is corrupt.
+static Type **read_types(char *p, size_t len, PchHeader *hdr) {
+  PchType *arr = (PchType *)(p + hdr->types);
+  Type **types = arena_alloc(&node_arena, (hdr->ntypes + 1) * sizeof(Type *));
+
+  // types[i] is the type referred to as i, so types[0] is NULL.
+  for (int i = 0; i < hdr->ntypes; i++) {
+    PchType *t = &arr[i];
+    if (t->base > i || t->return_ty > i ||
+        !in_file(len, t->params, t->nparams, sizeof(uint32_t)))
+      return NULL;
+
+    Type *base = types[t->base];
+    Type *ty;
+
+    switch (t->kind) {
+    case TY_CHAR:
+      ty = ty_char;
+      break;
+    case TY_INT:
+      ty = ty_int;
+      break;
+    case TY_PTR:
+      if (!base)
+        return NULL;
+      ty = pointer_to(base);
+      break;
+    case TY_ARRAY:
+      if (!base)
+        return NULL;
+      ty = array_of(base, t->array_len);
+      break;
+    case TY_FUNC: {
+      if (!types[t->return_ty])
+        return NULL;
+      uint32_t *refs = (uint32_t *)(p + t->params);
+      Type **params = arena_alloc(&node_arena, (t->nparams + 1) * sizeof(Type *));
+      for (int j = 0; j < t->nparams; j++) {
+        if (refs[j] == 0 || refs[j] > i)
+          return NULL;
+        params[j] = types[refs[j]];
+      }
+      ty = func_type(types[t->return_ty], params, t->nparams);
+      break;
+    }
+    default:
+      return NULL;
+    }
+    types[i + 1] = ty;
+  }
+  return types;
+}
+
+static bool read_vars(char *p, size_t len, PchHeader *hdr, Type **types,
+                      Obj **vars) {
+  PchVar *arr = (PchVar *)(p + hdr->vars);
+  Obj head = {};
+  Obj *cur = &head;
+
+  for (int i = 0; i < hdr->nvars; i++) {
+    PchVar *v = &arr[i];
+    if (!valid_str(p, len, v->name) || v->ty == 0 || v->ty > hdr->ntypes)
+      return false;
+
+    Obj *var = arena_alloc(&node_arena, sizeof(Obj));
+    char *name = p + v->name;
+    var->name = intern(name, strlen(name));
+    var->ty = types[v->ty];
+
+    if (v->init_data) {
+      if (!in_file(len, v->init_data, var->ty->size, 1))
+        return false;
+      var->init_data = arena_strndup(&token_arena, p + v->init_data,
+                                     var->ty->size);
+    }
+    cur = cur->next = var;
+  }
+
+  *vars = head.next;
+  return true;
+}
+
+// Reads a precompiled header if it is valid for the current `env`.
+// On success, returns the macro definitions and sets *vars to the
+// global variables in declaration order. The files that the header
+// was made from are registered as input files, as if they had been
+// read, so that they are known as dependencies of the output.
+char *read_pch(char *path, char *env, Obj **vars) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < sizeof(PchHeader)) {
+    close(fd);
+    return NULL;
+  }
+
+  size_t len = st.st_size;
+  char *p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return NULL;
+
+  PchHeader *hdr = (PchHeader *)p;
+  uint8_t id[32];
+  get_compiler_id(id);
+
+  char *macros = NULL;
+  Type **types;
+
+  if (memcmp(hdr->magic, PCH_MAGIC, 8) == 0 &&
+      memcmp(hdr->compiler, id, 32) == 0 &&
+      valid_str(p, len, hdr->env) && strcmp(p + hdr->env, env) == 0 &&
+      valid_str(p, len, hdr->macros) &&
+      in_file(len, hdr->deps, hdr->ndeps, sizeof(PchDep)) &&
+      in_file(len, hdr->types, hdr->ntypes, sizeof(PchType)) &&
+      in_file(len, hdr->vars, hdr->nvars, sizeof(PchVar)) &&
+      deps_unchanged(p, len, hdr) &&
+      (types = read_types(p, len, hdr)) &&
+      read_vars(p, len, hdr, types, vars)) {
+    char *s = p + hdr->macros;
+    macros = arena_strndup(&token_arena, s, strlen(s));
+
+    PchDep *deps = (PchDep *)(p + hdr->deps);
+    for (int i = 0; i < hdr->ndeps; i++) {
+      char *s = p + deps[i].path;
+      load_file(arena_strndup(&token_arena, s, strlen(s)));
+    }
+  }
+
+  munmap(p, len);
+  return macros;
+}
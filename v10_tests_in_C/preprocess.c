@@ -0,0 +1,1171 @@
+// This file implements the C preprocessor.
+//
+// The preprocessor takes the token array of the input file and
+// returns a new token array in which directives have been executed
+// and macros have been expanded. It runs between the tokenizer and
+// the parser, so no separate `cc -E` pass is needed.
+//
+// Included files are tokenized when they are included, and their
+// tokens take the place of the #include line. If a header is wrapped
+// in an include guard, i.e. `#ifndef FOO` `#define FOO` ... `#endif`,
+// we remember the guard macro, and including the header again while
+// the macro is defined does nothing at all: the file isn't even read.
+//
+// Macro arguments are fully expanded before they are substituted,
+// unless they are operands of # or ##. The result of a substitution
+// is then rescanned together with the rest of the input. A macro is
+// not expanded again while its own expansion is being rescanned, and
+// a name that wasn't expanded for that reason is marked `no_expand`
+// so that it stays unexpanded for good.
+//
+// If the first file included has a valid precompiled header (see
+// pch.c), the macros and global variables it records are loaded
+// instead of reading the file.
+
+#include "chibicc.h"
+#include <unistd.h>
+
+// Growable array of tokens
+typedef struct {
+  Token *data;
+  int len;
+  int capacity;
+} TokVec;
+
+typedef struct {
+  char *name;       // Interned
+  bool is_objlike;  // Object-like or function-like
+  char **params;    // Interned parameter names
+  int nparams;
+  Token *body;      // Replacement list, part of the defining file's tokens
+  int body_len;
+  bool active;      // True while the expansion is being rescanned
+} Macro;
+
+// Defined macros, in a hash table keyed by interned name. #undef
+// clears the `macro` of a slot but leaves the name in place.
+typedef struct {
+  char *name;
+  Macro *macro;
+} MacroSlot;
+
+static MacroSlot *macros;
+static int macros_capacity;
+static int macros_used;
+static int nr_macros; // Number of macros currently defined
+
+// #if, #ifdef and #ifndef that haven't been closed by #endif yet
+typedef enum { IN_THEN, IN_ELIF, IN_ELSE } CondCtx;
+
+typedef struct {
+  CondCtx ctx;
+  Token *tok;
+  bool included;
+} CondIncl;
+
+static CondIncl *conds;
+static int nr_conds;
+static int conds_capacity;
+
+// Directories searched by #include, see add_include_path()
+static char **include_paths;
+static int nr_include_paths;
+
+// Headers found to have an include guard
+typedef struct {
+  char *path;  // Interned
+  char *macro; // Interned
+} IncludeGuard;
+
+static IncludeGuard *guards;
+static int nr_guards;
+
+static int include_depth;
+
+Obj *pch_globals;
+
+// True once a precompiled header has been looked for
+static bool pch_tried;
+
+// Output of the preprocessor
+static TokVec output;
+
+static void expand(TokVec *out, Token *tok, Token *end);
+
+static Token *push_token(TokVec *vec, Token *tok) {
+  if (vec->len == vec->capacity) {
+    vec->capacity = vec->capacity ? vec->capacity * 2 : 64;
+    vec->data = realloc(vec->data, vec->capacity * sizeof(Token));
+    if (!vec->data)
+      error("out of memory");
+  }
+  Token *t = &vec->data[vec->len++];
+  *t = *tok;
+  return t;
+}
+
+static void push_tokens(TokVec *vec, Token *tok, Token *end) {
+  for (; tok < end; tok++)
+    push_token(vec, tok);
+}
+
+static bool is_ident(Token *tok) {
+  return tok->kind == TK_IDENT || tok->kind == TK_KEYWORD;
+}
+
+// Returns true if a given token is the '#' that starts a directive.
+static bool is_hash(Token *tok) {
+  return tok->at_bol && tok->id == '#';
+}
+
+// Returns the first token of the next line.
+static Token *skip_line(Token *tok) {
+  while (!tok->at_bol)
+    tok++;
+  return tok;
+}
+
+//
+// Macro table
+//
+
+static int hash_ptr(void *p, int capacity) {
+  return (int)(((uintptr_t)p >> 4) * 0x9E3779B97F4A7C15ULL >> 32) & (capacity - 1);
+}
+
+static MacroSlot *get_macro_slot(char *name) {
+  if (macros_used * 2 >= macros_capacity) {
+    MacroSlot *old = macros;
+    int old_capacity = macros_capacity;
+
+    macros_capacity = old_capacity ? old_capacity * 2 : 256;
+    macros = calloc(macros_capacity, sizeof(MacroSlot));
+
+    for (int i = 0; i < old_capacity; i++) {
+      if (!old[i].name)
+        continue;
+      int j = hash_ptr(old[i].name, macros_capacity);
+      while (macros[j].name)
+        j = (j + 1) & (macros_capacity - 1);
+      macros[j] = old[i];
+    }
+    free(old);
+  }
+
+  int i = hash_ptr(name, macros_capacity);
+  for (; macros[i].name; i = (i + 1) & (macros_capacity - 1))
+    if (macros[i].name == name)
+      return &macros[i];
+
+  macros[i].name = name;
+  macros_used++;
+  return &macros[i];
+}
+
+static Macro *find_macro_by_name(char *name) {
+  if (nr_macros == 0)
+    return NULL;
+  return get_macro_slot(name)->macro;
+}
+
+static Macro *find_macro(Token *tok) {
+  if (!is_ident(tok) || tok->no_expand)
+    return NULL;
+  return find_macro_by_name(tok->ident);
+}
+
+static void add_macro(Macro *m) {
+  MacroSlot *slot = get_macro_slot(m->name);
+  if (!slot->macro)
+    nr_macros++;
+  slot->macro = m;
+}
+
+static void undef_macro(char *name) {
+  MacroSlot *slot = get_macro_slot(name);
+  if (slot->macro)
+    nr_macros--;
+  slot->macro = NULL;
+}
+
+//
+// Macro definition
+//
+
+static Token *read_macro_params(Token *tok, Macro *m) {
+  int capacity = 0;
+
+  if (tok->id == ')')
+    return tok + 1;
+
+  for (;;) {
+    if (!is_ident(tok) || tok->at_bol)
+      error_tok(tok, "expected a parameter name");
+
+    if (m->nparams == capacity) {
+      capacity = capacity ? capacity * 2 : 8;
+      char **arr = arena_alloc(&token_arena, capacity * sizeof(char *));
+      memcpy(arr, m->params, m->nparams * sizeof(char *));
+      m->params = arr;
+    }
+    m->params[m->nparams++] = tok->ident;
+    tok++;
+
+    if (tok->id == ')' && !tok->at_bol)
+      return tok + 1;
+    if (tok->id != ',' || tok->at_bol)
+      error_tok(tok, "expected ',' or ')'");
+    tok++;
+  }
+}
+
+static Token *read_macro_definition(Token *tok) {
+  if (!is_ident(tok) || tok->at_bol)
+    error_tok(tok, "macro name must be an identifier");
+
+  Macro *m = arena_alloc(&token_arena, sizeof(Macro));
+  m->name = tok->ident;
+  tok++;
+
+  // A function-like macro has no space between its name and '('.
+  if (tok->id == '(' && !tok->at_bol && !tok->has_space) {
+    tok = read_macro_params(tok + 1, m);
+  } else {
+    m->is_objlike = true;
+  }
+
+  Token *end = skip_line(tok);
+  m->body = tok;
+  m->body_len = end - tok;
+  add_macro(m);
+  return end;
+}
+
+// Defines an object-like macro, e.g. for -D.
+void define_macro(char *name, char *buf) {
+  File *file = new_file("<built-in>", format("%s\n", buf));
+  Token *tok = tokenize(file);
+
+  Macro *m = arena_alloc(&token_arena, sizeof(Macro));
+  m->name = intern(name, strlen(name));
+  m->is_objlike = true;
+  m->body = tok;
+  while (tok->kind != TK_EOF)
+    tok++;
+  m->body_len = tok - m->body;
+  add_macro(m);
+}
+
+static int compare_macros(const void *a, const void *b) {
+  return strcmp((*(Macro **)a)->name, (*(Macro **)b)->name);
+}
+
+// Returns the definitions of the macros currently defined as a
+// sequence of #define lines, sorted by name. Defining them in an
+// empty macro table recreates the current one.
+char *macro_definitions(void) {
+  Macro **arr = calloc(nr_macros + 1, sizeof(Macro *));
+  int n = 0;
+  for (int i = 0; i < macros_capacity; i++)
+    if (macros[i].macro)
+      arr[n++] = macros[i].macro;
+  qsort(arr, n, sizeof(Macro *), compare_macros);
+
+  char *buf;
+  size_t len;
+  FILE *out = open_memstream(&buf, &len);
+
+  for (int i = 0; i < n; i++) {
+    Macro *m = arr[i];
+    fprintf(out, "#define %s", m->name);
+
+    if (!m->is_objlike) {
+      fprintf(out, "(");
+      for (int j = 0; j < m->nparams; j++)
+        fprintf(out, "%s%s", j ? ", " : "", m->params[j]);
+      fprintf(out, ")");
+    }
+
+    // The body is always separated from the name, so that an
+    // object-like macro whose body starts with '(' stays object-like.
+    for (int j = 0; j < m->body_len; j++) {
+      Token *t = &m->body[j];
+      if (j == 0 || t->has_space)
+        fprintf(out, " ");
+      fprintf(out, "%.*s", t->len, token_text(t));
+    }
+    fprintf(out, "\n");
+  }
+
+  fclose(out);
+  free(arr);
+  return buf;
+}
+
+//
+// Macro expansion
+//
+
+// Macro expansion reads tokens from a stack of token ranges. The
+// bottom one is the input; the others are expansions of macros that
+// are being rescanned.
+typedef struct {
+  Token *tok;
+  Token *end;
+  Macro *macro;  // Macro being expanded, or NULL
+  Token *owned;  // Buffer to free when the range is exhausted
+} Frame;
+
+typedef struct {
+  Frame *frames;
+  int depth;
+  int capacity;
+
+  // The first token of a macro expansion takes the place of the macro
+  // name in the output, so it gets the name's at_bol and has_space.
+  bool pending;
+  bool at_bol;
+  bool has_space;
+} Stream;
+
+static void push_frame(Stream *st, Token *tok, Token *end, Macro *m,
+                       Token *owned) {
+  if (st->depth == st->capacity) {
+    st->capacity = st->capacity ? st->capacity * 2 : 16;
+    st->frames = realloc(st->frames, st->capacity * sizeof(Frame));
+  }
+  st->frames[st->depth++] = (Frame){tok, end, m, owned};
+  if (m)
+    m->active = true;
+}
+
+// Returns the next token without consuming it, or NULL at the end of
+// the input. Exhausted ranges are popped, which re-enables the
+// macros they were expanded from.
+static Token *peek(Stream *st) {
+  while (st->depth > 0) {
+    Frame *f = &st->frames[st->depth - 1];
+    if (f->tok < f->end)
+      return f->tok;
+    if (f->macro)
+      f->macro->active = false;
+    free(f->owned);
+    st->depth--;
+  }
+  return NULL;
+}
+
+static Token *next(Stream *st) {
+  Token *tok = peek(st);
+  if (tok)
+    st->frames[st->depth - 1].tok++;
+  return tok;
+}
+
+static Token *emit_token(TokVec *out, Stream *st, Token *tok) {
+  Token *t = push_token(out, tok);
+  if (st->pending) {
+    t->at_bol = st->at_bol;
+    t->has_space = st->has_space;
+    st->pending = false;
+  }
+  return t;
+}
+
+static int find_param(Macro *m, Token *tok) {
+  if (!is_ident(tok))
+    return -1;
+  for (int i = 0; i < m->nparams; i++)
+    if (m->params[i] == tok->ident)
+      return i;
+  return -1;
+}
+
+// Tokenizes a string made up by the preprocessor. The new file is
+// named after the file in which `tmpl` appears.
+static Token *tokenize_string(Token *tmpl, char *buf) {
+  File *file = new_file(get_file(tmpl)->name, buf);
+  return tokenize(file);
+}
+
+// Returns a string literal token for the spelling of `arg`, which is
+// what `#arg` turns into.
+static Token *stringize(Token *hash, TokVec *arg) {
+  size_t len = 3;
+  for (int i = 0; i < arg->len; i++)
+    len += arg->data[i].len * 2 + 1;
+
+  char *buf = arena_alloc(&token_arena, len + 2);
+  char *p = buf;
+  *p++ = '"';
+
+  for (int i = 0; i < arg->len; i++) {
+    Token *t = &arg->data[i];
+    if (i > 0 && t->has_space)
+      *p++ = ' ';
+
+    char *s = token_text(t);
+    for (int j = 0; j < t->len; j++) {
+      if (t->kind == TK_STR && (s[j] == '"' || s[j] == '\\'))
+        *p++ = '\\';
+      *p++ = s[j];
+    }
+  }
+  strcpy(p, "\"\n");
+  return tokenize_string(hash, buf);
+}
+
+// Concatenates the spellings of two tokens for ##.
+static Token paste(Token *lhs, Token *rhs) {
+  char *buf = arena_alloc(&token_arena, lhs->len + rhs->len + 2);
+  memcpy(buf, token_text(lhs), lhs->len);
+  memcpy(buf + lhs->len, token_text(rhs), rhs->len);
+  strcpy(buf + lhs->len + rhs->len, "\n");
+
+  Token *tok = tokenize_string(lhs, buf);
+  if (tok[1].kind != TK_EOF)
+    error_tok(lhs, "pasting forms '%s', an invalid token", buf);
+
+  Token t = *tok;
+  t.at_bol = lhs->at_bol;
+  t.has_space = lhs->has_space;
+  return t;
+}
+
+// Appends `arg` to `vec`. The first token takes the flags of the
+// parameter name it replaces.
+static void push_arg(TokVec *vec, Token *param, TokVec *arg) {
+  for (int i = 0; i < arg->len; i++) {
+    Token *t = push_token(vec, &arg->data[i]);
+    if (i == 0) {
+      t->at_bol = param->at_bol;
+      t->has_space = param->has_space;
+    }
+  }
+}
+
+// Replaces parameters in the body of a function-like macro with
+// the actual arguments.
+static TokVec subst(Macro *m, TokVec *args) {
+  TokVec vec = {0};
+  Token *body = m->body;
+  int len = m->body_len;
+
+  // True if the previous token was a parameter with an empty
+  // argument, which the operator ## treats as a placemarker.
+  bool placemarker = false;
+
+  for (int i = 0; i < len; i++) {
+    Token *tok = &body[i];
+
+    // "#" followed by a parameter is replaced with its spelling.
+    if (tok->id == '#') {
+      int p = (i + 1 < len) ? find_param(m, &body[i + 1]) : -1;
+      if (p == -1)
+        error_tok(tok, "'#' is not followed by a macro parameter");
+      Token *t = push_token(&vec, stringize(tok, &args[p]));
+      t->at_bol = tok->at_bol;
+      t->has_space = tok->has_space;
+      i++;
+      placemarker = false;
+      continue;
+    }
+
+    // x ## y pastes the last token of x and the first token of y.
+    if (tok->id == PU_HASHHASH) {
+      if (i + 1 == len || (vec.len == 0 && !placemarker))
+        error_tok(tok, "'##' cannot appear at either end of macro expansion");
+
+      Token *rhs = &body[i + 1];
+      int p = find_param(m, rhs);
+      TokVec one = {rhs, 1, 1};
+      TokVec *arg = (p == -1) ? &one : &args[p];
+
+      if (placemarker) {
+        push_arg(&vec, rhs, arg);
+      } else if (arg->len > 0) {
+        vec.data[vec.len - 1] = paste(&vec.data[vec.len - 1], &arg->data[0]);
+        push_tokens(&vec, arg->data + 1, arg->data + arg->len);
+      }
+      placemarker = placemarker && arg->len == 0;
+      i++;
+      continue;
+    }
+
+    int p = find_param(m, tok);
+    if (p == -1) {
+      push_token(&vec, tok);
+      placemarker = false;
+      continue;
+    }
+
+    // An operand of ## is substituted without being expanded.
+    if (i + 1 < len && body[i + 1].id == PU_HASHHASH) {
+      push_arg(&vec, tok, &args[p]);
+      placemarker = (args[p].len == 0);
+      continue;
+    }
+
+    TokVec expanded = {0};
+    expand(&expanded, args[p].data, args[p].data + args[p].len);
+    push_arg(&vec, tok, &expanded);
+    free(expanded.data);
+    placemarker = false;
+  }
+  return vec;
+}
+
+// Reads the arguments of a function-like macro call. The macro name
+// and '(' have already been consumed.
+static TokVec *read_macro_args(Stream *st, Token *name, Macro *m) {
+  TokVec *args = calloc(m->nparams ? m->nparams : 1, sizeof(TokVec));
+  int nargs = 0;
+  int depth = 0;
+
+  for (;;) {
+    Token *tok = next(st);
+    if (!tok || tok->kind == TK_EOF)
+      error_tok(name, "unterminated macro argument list");
+
+    if (depth == 0 && tok->id == ')')
+      break;
+    if (depth == 0 && tok->id == ',') {
+      if (++nargs >= m->nparams)
+        error_tok(name, "too many arguments");
+      continue;
+    }
+
+    if (tok->id == '(')
+      depth++;
+    else if (tok->id == ')')
+      depth--;
+
+    if (m->nparams == 0)
+      error_tok(name, "too many arguments");
+    push_token(&args[nargs], tok);
+  }
+
+  // A macro with one parameter may be called with an empty argument.
+  if (m->nparams > 0 && nargs + 1 != m->nparams)
+    error_tok(name, "too few arguments");
+  return args;
+}
+
+// Expands macros in the tokens [tok, end) and appends the result
+// to `out`.
+static void expand(TokVec *out, Token *tok, Token *end) {
+  if (nr_macros == 0) {
+    push_tokens(out, tok, end);
+    return;
+  }
+
+  Stream st = {0};
+  push_frame(&st, tok, end, NULL, NULL);
+
+  while ((tok = next(&st))) {
+    Macro *m = find_macro(tok);
+    if (!m) {
+      emit_token(out, &st, tok);
+      continue;
+    }
+
+    if (m->active) {
+      emit_token(out, &st, tok)->no_expand = true;
+      continue;
+    }
+
+    // Reading ahead may free the range `tok` is in.
+    Token name = *tok;
+
+    // A function-like macro name not followed by '(' is an
+    // ordinary identifier.
+    if (!m->is_objlike) {
+      Token *lparen = peek(&st);
+      if (!lparen || lparen->id != '(') {
+        emit_token(out, &st, &name);
+        continue;
+      }
+      next(&st);
+    }
+
+    if (!st.pending) {
+      st.pending = true;
+      st.at_bol = name.at_bol;
+      st.has_space = name.has_space;
+    }
+
+    if (m->is_objlike) {
+      push_frame(&st, m->body, m->body + m->body_len, m, NULL);
+      continue;
+    }
+
+    TokVec *args = read_macro_args(&st, &name, m);
+    TokVec vec = subst(m, args);
+    for (int i = 0; i < m->nparams; i++)
+      free(args[i].data);
+    free(args);
+
+    push_frame(&st, vec.data, vec.data + vec.len, m, vec.data);
+  }
+
+  free(st.frames);
+}
+
+//
+// #if
+//
+
+static long eval_cond(Token **rest, Token *tok);
+
+static long eval_primary(Token **rest, Token *tok) {
+  if (tok->id == '(') {
+    long val = eval_cond(&tok, tok + 1);
+    *rest = skip(tok, ")");
+    return val;
+  }
+
+  if (tok->kind == TK_NUM) {
+    *rest = tok + 1;
+    return tok->val;
+  }
+
+  // Identifiers that are not macros evaluate to 0.
+  if (is_ident(tok)) {
+    *rest = tok + 1;
+    return 0;
+  }
+
+  error_tok(tok, "invalid expression in #if");
+}
+
+static long eval_unary(Token **rest, Token *tok) {
+  switch (tok->id) {
+  case '+':
+    return eval_unary(rest, tok + 1);
+  case '-':
+    return -eval_unary(rest, tok + 1);
+  case '!':
+    return !eval_unary(rest, tok + 1);
+  case '~':
+    return ~eval_unary(rest, tok + 1);
+  }
+  return eval_primary(rest, tok);
+}
+
+static int binary_prec(Token *tok) {
+  switch (tok->id) {
+  case '*': case '/': case '%':
+    return 10;
+  case '+': case '-':
+    return 9;
+  case PU_SHL: case PU_SHR:
+    return 8;
+  case '<': case '>': case PU_LE: case PU_GE:
+    return 7;
+  case PU_EQ: case PU_NE:
+    return 6;
+  case '&':
+    return 5;
+  case '^':
+    return 4;
+  case '|':
+    return 3;
+  case PU_LOGAND:
+    return 2;
+  case PU_LOGOR:
+    return 1;
+  }
+  return 0;
+}
+
+// Binary operators, by precedence climbing.
+static long eval_binary(Token **rest, Token *tok, int min_prec) {
+  long lhs = eval_unary(&tok, tok);
+
+  for (;;) {
+    Token *op = tok;
+    int prec = binary_prec(op);
+    if (prec == 0 || prec < min_prec)
+      break;
+
+    long rhs = eval_binary(&tok, tok + 1, prec + 1);
+
+    switch (op->id) {
+    case '*': lhs = lhs * rhs; break;
+    case '/':
+    case '%':
+      if (rhs == 0)
+        error_tok(op, "division by zero in #if");
+      lhs = (op->id == '/') ? lhs / rhs : lhs % rhs;
+      break;
+    case '+': lhs = lhs + rhs; break;
+    case '-': lhs = lhs - rhs; break;
+    case PU_SHL: lhs = lhs << rhs; break;
+    case PU_SHR: lhs = lhs >> rhs; break;
+    case '<': lhs = lhs < rhs; break;
+    case '>': lhs = lhs > rhs; break;
+    case PU_LE: lhs = lhs <= rhs; break;
+    case PU_GE: lhs = lhs >= rhs; break;
+    case PU_EQ: lhs = lhs == rhs; break;
+    case PU_NE: lhs = lhs != rhs; break;
+    case '&': lhs = lhs & rhs; break;
+    case '^': lhs = lhs ^ rhs; break;
+    case '|': lhs = lhs | rhs; break;
+    case PU_LOGAND: lhs = lhs && rhs; break;
+    case PU_LOGOR: lhs = lhs || rhs; break;
+    }
+  }
+
+  *rest = tok;
+  return lhs;
+}
+
+static long eval_cond(Token **rest, Token *tok) {
+  long cond = eval_binary(&tok, tok, 1);
+  if (tok->id != '?') {
+    *rest = tok;
+    return cond;
+  }
+
+  long then = eval_cond(&tok, tok + 1);
+  tok = skip(tok, ":");
+  long els = eval_cond(rest, tok);
+  return cond ? then : els;
+}
+
+// Reads the rest of an #if or #elif line and evaluates it.
+static long eval_const_expr(Token **rest, Token *tok) {
+  Token *end = skip_line(tok);
+  *rest = end;
+
+  if (tok == end)
+    error_tok(tok, "no expression");
+
+  // Replace `defined(FOO)` and `defined FOO` with 1 or 0 before
+  // macros are expanded.
+  TokVec line = {0};
+  while (tok < end) {
+    if (!equal(tok, "defined")) {
+      push_token(&line, tok++);
+      continue;
+    }
+
+    Token *t = tok++;
+    bool has_paren = (tok < end && tok->id == '(');
+    if (has_paren)
+      tok++;
+    if (tok == end || !is_ident(tok))
+      error_tok(t, "macro name must be an identifier");
+
+    Token *num = push_token(&line, t);
+    num->kind = TK_NUM;
+    num->val = find_macro_by_name(tok->ident) != NULL;
+    tok++;
+
+    if (has_paren) {
+      if (tok == end || tok->id != ')')
+        error_tok(t, "expected ')'");
+      tok++;
+    }
+  }
+
+  TokVec expr = {0};
+  expand(&expr, line.data, line.data + line.len);
+
+  // Terminate the expression with an EOF token placed right after
+  // the last token of the line.
+  Token eof = end[-1];
+  eof.kind = TK_EOF;
+  eof.id = 0;
+  eof.pos += eof.len;
+  eof.len = 0;
+  push_token(&expr, &eof);
+
+  Token *tok2;
+  long val = eval_cond(&tok2, expr.data);
+  if (tok2->kind != TK_EOF)
+    error_tok(tok2, "extra token");
+
+  free(line.data);
+  free(expr.data);
+  return val;
+}
+
+static void push_cond(Token *tok, bool included) {
+  if (nr_conds == conds_capacity) {
+    conds_capacity = conds_capacity ? conds_capacity * 2 : 16;
+    conds = realloc(conds, conds_capacity * sizeof(CondIncl));
+  }
+  conds[nr_conds++] = (CondIncl){IN_THEN, tok, included};
+}
+
+static bool is_if_directive(Token *tok) {
+  return equal(tok, "if") || equal(tok, "ifdef") || equal(tok, "ifndef");
+}
+
+// Skips until the next #elif, #else or #endif that belongs to the
+// current conditional, skipping nested ones. Returns its '#'.
+static Token *skip_cond_incl(Token *tok) {
+  int depth = 0;
+
+  for (; tok->kind != TK_EOF; tok++) {
+    if (!is_hash(tok))
+      continue;
+
+    Token *dir = tok + 1;
+    if (is_if_directive(dir)) {
+      depth++;
+    } else if (equal(dir, "endif")) {
+      if (depth == 0)
+        return tok;
+      depth--;
+    } else if (depth == 0 && (equal(dir, "elif") || equal(dir, "else"))) {
+      return tok;
+    }
+  }
+  return tok;
+}
+
+//
+// #include
+//
+
+void add_include_path(char *path) {
+  if ((nr_include_paths & (nr_include_paths - 1)) == 0) {
+    int n = nr_include_paths ? nr_include_paths * 2 : 8;
+    include_paths = realloc(include_paths, n * sizeof(char *));
+  }
+  include_paths[nr_include_paths++] = path;
+}
+
+static bool file_exists(char *path) {
+  return access(path, R_OK) == 0;
+}
+
+// Finds a file for #include. "foo.h" is looked up in the directory of
+// the including file first, then in the -I directories. <foo.h> is
+// looked up only in the -I directories.
+static char *search_include(Token *tok, char *name, bool quoted) {
+  if (name[0] == '/')
+    return name;
+
+  if (quoted) {
+    char *cur = get_file(tok)->name;
+    char *slash = strrchr(cur, '/');
+    char *path = slash ? format("%.*s/%s", (int)(slash - cur), cur, name)
+                       : name;
+    if (file_exists(path))
+      return path;
+  }
+
+  for (int i = 0; i < nr_include_paths; i++) {
+    char *path = format("%s/%s", include_paths[i], name);
+    if (file_exists(path))
+      return path;
+  }
+
+  error_tok(tok, "'%s' file not found", name);
+}
+
+// If a file consists of `#ifndef FOO` `#define FOO` ... `#endif`
+// and nothing else, returns FOO.
+static char *detect_include_guard(Token *tok) {
+  if (!is_hash(tok) || !equal(tok + 1, "ifndef") || !is_ident(tok + 2))
+    return NULL;
+
+  char *macro = tok[2].ident;
+  tok = skip_line(tok + 3);
+  if (!is_hash(tok) || !equal(tok + 1, "define") || !is_ident(tok + 2) ||
+      tok[2].ident != macro)
+    return NULL;
+
+  tok = skip_cond_incl(tok);
+  if (tok->kind == TK_EOF || !equal(tok + 1, "endif"))
+    return NULL;
+  return skip_line(tok + 2)->kind == TK_EOF ? macro : NULL;
+}
+
+static IncludeGuard *find_guard(char *path) {
+  for (int i = 0; i < nr_guards; i++)
+    if (guards[i].path == path)
+      return &guards[i];
+  return NULL;
+}
+
+static void add_guard(char *path, char *macro) {
+  if ((nr_guards & (nr_guards - 1)) == 0) {
+    int n = nr_guards ? nr_guards * 2 : 16;
+    guards = realloc(guards, n * sizeof(IncludeGuard));
+  }
+  guards[nr_guards++] = (IncludeGuard){path, macro};
+}
+
+// Returns what a file being included would see of the preprocessor's
+// state: the include paths and the macro definitions.
+char *preprocessor_env(void) {
+  char *buf;
+  size_t len;
+  FILE *out = open_memstream(&buf, &len);
+
+  for (int i = 0; i < nr_include_paths; i++)
+    fprintf(out, "-I%s\n", include_paths[i]);
+
+  char *defs = macro_definitions();
+  fprintf(out, "%s", defs);
+  free(defs);
+
+  fclose(out);
+  return buf;
+}
+
+static void preprocess_file(Token *tok);
+
+// Loads the precompiled header of `path` if it is valid. Its macros
+// replace the current ones, which it was made with, and its global
+// variables are left in pch_globals for the parser.
+static bool include_pch(char *path) {
+  char *pch = format("%s.pch", path);
+  if (!file_exists(pch)) {
+    free(pch);
+    return false;
+  }
+
+  char *env = preprocessor_env();
+  Obj *vars;
+  char *defs = read_pch(pch, env, &vars);
+  free(env);
+  if (!defs) {
+    free(pch);
+    return false;
+  }
+
+  if (macros)
+    memset(macros, 0, macros_capacity * sizeof(MacroSlot));
+  macros_used = 0;
+  nr_macros = 0;
+  if (*defs)
+    preprocess_file(tokenize(new_file(pch, defs)));
+
+  pch_globals = vars;
+  return true;
+}
+
+// Reads the rest of an #include line and includes the file.
+static Token *include_file(Token *hash, Token *tok) {
+  char *name;
+  bool quoted;
+
+  if (tok->kind == TK_STR && !tok->at_bol) {
+    // #include "foo.h"
+    name = str_literal(tok)->str;
+    quoted = true;
+    tok++;
+  } else if (tok->id == '<' && !tok->at_bol) {
+    // #include <foo.h>
+    Token *start = ++tok;
+    for (; tok->id != '>'; tok++)
+      if (tok->at_bol)
+        error_tok(tok, "expected '>'");
+
+    // The name is spelled exactly as it appears in the source.
+    char *p = token_text(start);
+    name = arena_strndup(&token_arena, p, token_text(tok) - p);
+    quoted = false;
+    tok++;
+  } else {
+    error_tok(tok, "expected a filename");
+  }
+
+  Token *end = skip_line(tok);
+  char *path = search_include(hash, name, quoted);
+  path = intern(path, strlen(path));
+
+  // Only a header included before anything else has been output can
+  // be replaced with its precompiled version.
+  if (!pch_tried && include_depth == 0 && output.len == 0) {
+    pch_tried = true;
+    if (include_pch(path))
+      return end;
+  }
+
+  IncludeGuard *guard = find_guard(path);
+  if (guard && find_macro_by_name(guard->macro))
+    return end;
+
+  if (include_depth == 200)
+    error_tok(hash, "#include nested too deeply");
+
+  Token *inc = tokenize_file(path);
+  if (!inc)
+    error_tok(hash, "%s: cannot open file: %s", path, strerror(errno));
+
+  if (!guard) {
+    char *macro = detect_include_guard(inc);
+    if (macro)
+      add_guard(path, macro);
+  }
+
+  include_depth++;
+  preprocess_file(inc);
+  include_depth--;
+  return end;
+}
+
+//
+// Directives
+//
+
+// Preprocesses the tokens of a file and appends the result to the
+// output, without the file's EOF token.
+static void preprocess_file(Token *tok) {
+  int cond_base = nr_conds;
+
+  while (tok->kind != TK_EOF) {
+    // Lines that aren't directives are macro-expanded a run at a time.
+    if (!is_hash(tok)) {
+      Token *end = tok + 1;
+      while (end->kind != TK_EOF && !is_hash(end))
+        end++;
+      expand(&output, tok, end);
+      tok = end;
+      continue;
+    }
+
+    Token *hash = tok;
+    tok++;
+
+    // The null directive, a '#' alone on a line
+    if (tok->at_bol)
+      continue;
+
+    if (equal(tok, "include")) {
+      tok = include_file(hash, tok + 1);
+      continue;
+    }
+
+    if (equal(tok, "define")) {
+      tok = read_macro_definition(tok + 1);
+      continue;
+    }
+
+    if (equal(tok, "undef")) {
+      tok++;
+      if (!is_ident(tok) || tok->at_bol)
+        error_tok(tok, "macro name must be an identifier");
+      undef_macro(tok->ident);
+      tok = skip_line(tok + 1);
+      continue;
+    }
+
+    if (equal(tok, "if")) {
+      long val = eval_const_expr(&tok, tok + 1);
+      push_cond(hash, val);
+      if (!val)
+        tok = skip_cond_incl(tok);
+      continue;
+    }
+
+    if (equal(tok, "ifdef") || equal(tok, "ifndef")) {
+      bool want_defined = equal(tok, "ifdef");
+      tok++;
+      if (!is_ident(tok) || tok->at_bol)
+        error_tok(tok, "macro name must be an identifier");
+      bool defined = find_macro_by_name(tok->ident) != NULL;
+      push_cond(hash, defined == want_defined);
+      tok = skip_line(tok + 1);
+      if (defined != want_defined)
+        tok = skip_cond_incl(tok);
+      continue;
+    }
+
+    if (equal(tok, "elif")) {
+      if (nr_conds == cond_base || conds[nr_conds - 1].ctx == IN_ELSE)
+        error_tok(hash, "stray #elif");
+      CondIncl *cond = &conds[nr_conds - 1];
+      cond->ctx = IN_ELIF;
+
+      if (!cond->included && eval_const_expr(&tok, tok + 1))
+        cond->included = true;
+      else
+        tok = skip_cond_incl(skip_line(tok));
+      continue;
+    }
+
+    if (equal(tok, "else")) {
+      if (nr_conds == cond_base || conds[nr_conds - 1].ctx == IN_ELSE)
+        error_tok(hash, "stray #else");
+      CondIncl *cond = &conds[nr_conds - 1];
+      cond->ctx = IN_ELSE;
+      tok = skip_line(tok + 1);
+
+      if (cond->included)
+        tok = skip_cond_incl(tok);
+      continue;
+    }
+
+    if (equal(tok, "endif")) {
+      if (nr_conds == cond_base)
+        error_tok(hash, "stray #endif");
+      nr_conds--;
+      tok = skip_line(tok + 1);
+      continue;
+    }
+
+    if (equal(tok, "error"))
+      error_tok(tok, "#error");
+
+    // Pragmas are accepted and ignored.
+    if (equal(tok, "pragma")) {
+      tok = skip_line(tok + 1);
+      continue;
+    }
+
+    error_tok(tok, "invalid preprocessor directive");
+  }
+
+  if (nr_conds > cond_base)
+    error_tok(conds[nr_conds - 1].tok, "unterminated conditional directive");
+}
+
+// Returns true if a token array contains no directives.
+static bool has_directives(Token *tok) {
+  for (; tok->kind != TK_EOF; tok++)
+    if (is_hash(tok))
+      return true;
+  return false;
+}
+
+// Forgets the macros, include guards, conditionals, include paths and
+// precompiled header of the previous compilation.
+void reset_preprocessor(void) {
+  if (macros)
+    memset(macros, 0, macros_capacity * sizeof(MacroSlot));
+  macros_used = 0;
+  nr_macros = 0;
+  nr_conds = 0;
+  nr_guards = 0;
+  include_depth = 0;
+  output.len = 0;
+  nr_include_paths = 0;
+  pch_globals = NULL;
+  pch_tried = false;
+}
+
+// Entry point function of the preprocessor.
+Token *preprocess(Token *tok) {
+  // Most of the time there is nothing to do for a file without
+  // directives, so it's returned as is.
+  if (nr_macros == 0 && !has_directives(tok))
+    return tok;
+
+  phase_begin(PH_PREPROCESS);
+  output.len = 0;
+  preprocess_file(tok);
+
+  Token *eof = tok;
+  while (eof->kind != TK_EOF)
+    eof++;
+  push_token(&output, eof);
+  phase_end(PH_PREPROCESS);
+  return output.data;
+}
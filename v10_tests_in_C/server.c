@@ -0,0 +1,274 @@
+// This file contains the compile server and its client.
+//
+// Starting a compiler process costs more than compiling a small file:
+// exec, dynamic linking, page faults on a cold heap, and building the
+// keyword and type tables. `chibicc --server <socket>` pays for that
+// once and then compiles whatever it is asked to on a Unix domain
+// socket, reusing its arenas from one request to the next.
+// `chibicc --client <socket> <args>...` is a thin shim that forwards
+// its arguments, working directory and standard streams to the server
+// and exits with the status the server reports, so it can be used in
+// place of the compiler itself.
+//
+// A request is a message carrying the client's stdin, stdout and
+// stderr as SCM_RIGHTS file descriptors and a 32-bit length, followed
+// by that many bytes: the working directory and then each argument,
+// every one terminated with '\0'. The reply is a 32-bit exit status.
+
+#define _DEFAULT_SOURCE
+#include "chibicc.h"
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Arguments larger than this are surely not a compile request.
+#define MAX_REQUEST (1 << 20)
+
+static struct sockaddr_un socket_addr(char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path))
+    error("%s: socket path too long", path);
+  strcpy(addr.sun_path, path);
+  return addr;
+}
+
+static bool read_full(int fd, void *buf, size_t len) {
+  for (char *p = buf; len > 0;) {
+    ssize_t n = read(fd, p, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool write_full(int fd, void *buf, size_t len) {
+  for (char *p = buf; len > 0;) {
+    ssize_t n = write(fd, p, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Control message buffer big enough for three file descriptors
+typedef union {
+  char buf[CMSG_SPACE(3 * sizeof(int))];
+  struct cmsghdr align;
+} FdMsg;
+
+// Closes the file descriptors that a message carried. The kernel
+// installs them on receipt, so a rejected message must not leak them.
+static void close_fds(struct msghdr *msg) {
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg;
+       cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+
+    int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (int i = 0; i < n; i++) {
+      int fd;
+      memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      close(fd);
+    }
+  }
+}
+
+// Reads a request from a client connection. Returns the arguments as
+// a NULL-terminated argv whose strings point into *data, and stores
+// the client's standard streams to fds. Returns NULL if the request
+// is malformed.
+static char **read_request(int conn, int fds[3], char **data) {
+  uint32_t len;
+  FdMsg ctl;
+  struct iovec iov = {&len, sizeof(len)};
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = ctl.buf,
+    .msg_controllen = sizeof(ctl.buf),
+  };
+
+  ssize_t n = recvmsg(conn, &msg, 0);
+  if (n == -1)
+    return NULL;
+
+  // Anything but exactly three descriptors in one control message is
+  // malformed.
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (n != sizeof(len) || (msg.msg_flags & MSG_CTRUNC) || !cmsg ||
+      cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)) ||
+      CMSG_NXTHDR(&msg, cmsg)) {
+    close_fds(&msg);
+    return NULL;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+
+  if (len == 0 || len > MAX_REQUEST)
+    return NULL;
+
+  char *buf = malloc(len);
+  if (!read_full(conn, buf, len) || buf[len - 1] != '\0') {
+    free(buf);
+    return NULL;
+  }
+  *data = buf;
+
+  // buf is the working directory followed by the arguments. The
+  // working directory takes the place of argv[0].
+  StringArray args = {0};
+  for (char *p = buf; p < buf + len; p += strlen(p) + 1)
+    strarray_push(&args, p);
+  strarray_push(&args, NULL);
+  return args.data;
+}
+
+// Handles one client connection.
+static void serve(int conn, int (*compile)(char **argv)) {
+  int fds[3] = {-1, -1, -1};
+  char *data = NULL;
+  char **argv = read_request(conn, fds, &data);
+
+  int32_t status = 1;
+  if (argv && chdir(argv[0]) == 0) {
+    // Run the compiler with the client's standard streams.
+    int saved[3];
+    fflush(NULL);
+    for (int i = 0; i < 3; i++) {
+      saved[i] = dup(i);
+      dup2(fds[i], i);
+    }
+
+    status = compile(argv);
+
+    fflush(NULL);
+    for (int i = 0; i < 3; i++) {
+      dup2(saved[i], i);
+      close(saved[i]);
+    }
+  }
+
+  write_full(conn, &status, sizeof(status));
+
+  for (int i = 0; i < 3; i++)
+    if (fds[i] != -1)
+      close(fds[i]);
+  free(argv);
+  free(data);
+}
+
+static _Noreturn void accept_loop(int sock, int (*compile)(char **argv)) {
+  for (;;) {
+    int conn = accept(sock, NULL, NULL);
+    if (conn == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      error("accept failed: %s", strerror(errno));
+    }
+    serve(conn, compile);
+    close(conn);
+  }
+}
+
+// Listens on a Unix domain socket at `path` and passes each request
+// to `compile`, which returns the exit status for the client. With
+// nworkers > 1, that many processes accept requests concurrently; a
+// worker that dies, e.g. by a crash in the compiler, is replaced.
+_Noreturn void run_server(char *path, int nworkers, int (*compile)(char **argv)) {
+  struct sockaddr_un addr = socket_addr(path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock == -1)
+    error("socket failed: %s", strerror(errno));
+
+  // Remove the socket left by a previous server.
+  unlink(path);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    error("cannot bind to %s: %s", path, strerror(errno));
+  if (listen(sock, SOMAXCONN) == -1)
+    error("listen failed: %s", strerror(errno));
+
+  // A client going away must not kill the server.
+  signal(SIGPIPE, SIG_IGN);
+
+  if (nworkers <= 1)
+    accept_loop(sock, compile);
+
+  fflush(NULL);
+  for (int live = 0;;) {
+    while (live < nworkers) {
+      pid_t pid = fork();
+      if (pid == -1)
+        error("fork failed: %s", strerror(errno));
+      if (pid == 0)
+        accept_loop(sock, compile);
+      live++;
+    }
+
+    if (wait(NULL) == -1)
+      error("wait failed: %s", strerror(errno));
+    live--;
+  }
+}
+
+// Sends the arguments to the server at `path` and returns the exit
+// status of the compilation.
+int run_client(char *path, char **argv) {
+  struct sockaddr_un addr = socket_addr(path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock == -1)
+    error("socket failed: %s", strerror(errno));
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    error("cannot connect to %s: %s", path, strerror(errno));
+
+  char *cwd = getcwd(NULL, 0);
+  if (!cwd)
+    error("getcwd failed: %s", strerror(errno));
+
+  char *data;
+  size_t len;
+  FILE *out = open_memstream(&data, &len);
+  fwrite(cwd, strlen(cwd) + 1, 1, out);
+  for (int i = 0; argv[i]; i++)
+    fwrite(argv[i], strlen(argv[i]) + 1, 1, out);
+  fclose(out);
+
+  if (len > MAX_REQUEST)
+    error("arguments too long");
+
+  uint32_t len32 = len;
+  FdMsg ctl = {0};
+  struct iovec iov = {&len32, sizeof(len32)};
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = ctl.buf,
+    .msg_controllen = sizeof(ctl.buf),
+  };
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), (int[]){0, 1, 2}, 3 * sizeof(int));
+
+  if (sendmsg(sock, &msg, 0) != sizeof(len32) || !write_full(sock, data, len))
+    error("%s: cannot send request: %s", path, strerror(errno));
+
+  int32_t status;
+  if (!read_full(sock, &status, sizeof(status)))
+    error("%s: server closed the connection", path);
+  close(sock);
+  return status;
+}
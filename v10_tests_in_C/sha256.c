@@ -0,0 +1,122 @@
+// This file contains an implementation of SHA-256 (FIPS 180-4), which
+// the compile cache uses to name its entries.
+
+#include "chibicc.h"
+
+static const uint32_t k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+// This is a macro rather than a function because the compiler is
+// built without optimization, and SHA-256 is mostly rotations.
+#define ror(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// Processes one 64-byte block.
+static void compress(Sha256 *ctx, uint8_t *p) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++)
+    w[i] = (uint32_t)p[i * 4] << 24 | p[i * 4 + 1] << 16 |
+           p[i * 4 + 2] << 8 | p[i * 4 + 3];
+
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = ctx->h[0], b = ctx->h[1], c = ctx->h[2], d = ctx->h[3];
+  uint32_t e = ctx->h[4], f = ctx->h[5], g = ctx->h[6], h = ctx->h[7];
+
+  for (int i = 0; i < 64; i++) {
+    uint32_t s1 = ror(e, 6) ^ ror(e, 11) ^ ror(e, 25);
+    uint32_t ch = (e & f) ^ (~e & g);
+    uint32_t t1 = h + s1 + ch + k[i] + w[i];
+    uint32_t s0 = ror(a, 2) ^ ror(a, 13) ^ ror(a, 22);
+    uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+    uint32_t t2 = s0 + maj;
+
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  ctx->h[0] += a;
+  ctx->h[1] += b;
+  ctx->h[2] += c;
+  ctx->h[3] += d;
+  ctx->h[4] += e;
+  ctx->h[5] += f;
+  ctx->h[6] += g;
+  ctx->h[7] += h;
+}
+
+void sha256_init(Sha256 *ctx) {
+  static const uint32_t h[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+  };
+  memcpy(ctx->h, h, sizeof(h));
+  ctx->len = 0;
+}
+
+void sha256_update(Sha256 *ctx, void *data, size_t len) {
+  uint8_t *p = data;
+  int used = ctx->len % 64;
+  ctx->len += len;
+
+  // Fill up a partial block left by the previous call.
+  if (used) {
+    int n = 64 - used;
+    if (len < n) {
+      memcpy(ctx->buf + used, p, len);
+      return;
+    }
+    memcpy(ctx->buf + used, p, n);
+    compress(ctx, ctx->buf);
+    p += n;
+    len -= n;
+  }
+
+  for (; len >= 64; p += 64, len -= 64)
+    compress(ctx, p);
+  memcpy(ctx->buf, p, len);
+}
+
+void sha256_final(Sha256 *ctx, uint8_t digest[32]) {
+  uint64_t bits = ctx->len * 8;
+  uint8_t pad[72] = {0x80};
+  int used = ctx->len % 64;
+  int padlen = (used < 56 ? 56 : 120) - used;
+
+  for (int i = 0; i < 8; i++)
+    pad[padlen + i] = bits >> (56 - i * 8);
+  sha256_update(ctx, pad, padlen + 8);
+
+  for (int i = 0; i < 8; i++) {
+    digest[i * 4] = ctx->h[i] >> 24;
+    digest[i * 4 + 1] = ctx->h[i] >> 16;
+    digest[i * 4 + 2] = ctx->h[i] >> 8;
+    digest[i * 4 + 3] = ctx->h[i];
+  }
+}
+
+// Hashes a string including its terminating '\0', so that a sequence
+// of strings hashes differently from their concatenation.
+void sha256_str(Sha256 *ctx, char *s) {
+  sha256_update(ctx, s, strlen(s) + 1);
+}
@@ -0,0 +1,312 @@
+// This file collects the statistics printed by --stats: the time
+// spent in each phase of a compilation and counts of what the phases
+// produced.
+//
+// Phases nest; e.g. a header is read and tokenized in the middle of
+// preprocessing. Time is charged to the innermost phase only, so the
+// phase times add up to the time spent in all of them. When stats are
+// disabled, the only cost is a test of `stats_enabled` at each phase
+// boundary and a few counter increments.
+//
+// It also writes the timeline of --trace, in Chrome's trace event
+// format, which chrome://tracing and Perfetto can display. There is
+// an event for each phase, and for each function parsed and each
+// function compiled, on the thread that did it.
+
+#define _DEFAULT_SOURCE
+#include "chibicc.h"
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+bool stats_enabled;
+Stats stats;
+bool trace_enabled;
+
+static char *phase_names[] = {
+  [PH_READ_FILE] = "read_file",
+  [PH_TOKENIZE] = "tokenize",
+  [PH_PREPROCESS] = "preprocess",
+  [PH_PARSE] = "parse",
+  [PH_ADD_TYPE] = "add_type",
+  [PH_CODEGEN] = "codegen",
+  [PH_ASSEMBLE] = "assemble",
+};
+
+// Seconds spent in each phase
+static double wall[NR_PHASES];
+static double cpu[NR_PHASES];
+
+// Phases that have begun and not ended, innermost last, and when
+// they began
+static Phase stack[32];
+static double stack_ts[32];
+static int depth;
+
+static double last_wall;
+static double last_cpu;
+static double start_wall;
+static double start_cpu;
+
+// Column in the current line of assembly, see count_output()
+static int col;
+static bool indented;
+static bool is_insn;
+
+static double now(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Charges the time since the last phase boundary to the current
+// phase. Reading the CPU clock is a system call, which is too slow to
+// do around each add_type() call, so add_type() boundaries read only
+// the wall clock, and its CPU time is worked out in print_stats().
+static void charge(bool with_cpu) {
+  double w = now(CLOCK_MONOTONIC);
+  if (depth)
+    wall[stack[depth - 1]] += w - last_wall;
+  last_wall = w;
+
+  if (with_cpu) {
+    double c = now(CLOCK_PROCESS_CPUTIME_ID);
+    if (depth)
+      cpu[stack[depth - 1]] += c - last_cpu;
+    last_cpu = c;
+  }
+}
+
+void phase_begin(Phase phase) {
+  if (!stats_enabled && !trace_enabled)
+    return;
+  if (depth == sizeof(stack) / sizeof(*stack))
+    error("phases nested too deeply");
+
+  if (stats_enabled)
+    charge(phase != PH_ADD_TYPE);
+  stack_ts[depth] = trace_enabled && phase != PH_ADD_TYPE ? trace_now() : 0;
+  stack[depth++] = phase;
+}
+
+// Ends the innermost `phase`. Phases that an error longjmp()ed out
+// of are ended along with it. add_type() calls are too short and too
+// many to be worth a trace event each.
+void phase_end(Phase phase) {
+  if (!stats_enabled && !trace_enabled)
+    return;
+
+  if (stats_enabled)
+    charge(phase != PH_ADD_TYPE);
+
+  while (depth > 0) {
+    Phase p = stack[--depth];
+    if (trace_enabled && p != PH_ADD_TYPE)
+      trace_event("phase", phase_names[p], stack_ts[depth]);
+    if (p == phase)
+      break;
+  }
+}
+
+// Starts collecting statistics for a new compilation.
+void reset_stats(void) {
+  memset(wall, 0, sizeof(wall));
+  memset(cpu, 0, sizeof(cpu));
+  stats = (Stats){0};
+  depth = 0;
+  col = 0;
+  is_insn = false;
+  start_wall = last_wall = now(CLOCK_MONOTONIC);
+  start_cpu = last_cpu = now(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+// Counts the lines and instructions of assembly output. It may be
+// given in pieces that split lines. An instruction is an indented
+// line that isn't a directive; labels aren't indented.
+void count_output(char *p, size_t len) {
+  for (char *end = p + len; p < end; p++) {
+    if (*p == '\n') {
+      stats.lines++;
+      stats.insns += is_insn;
+      col = 0;
+      is_insn = false;
+      continue;
+    }
+
+    if (col < 2)
+      indented = (col == 0 || indented) && *p == ' ';
+    else if (col == 2)
+      is_insn = indented && *p != '.';
+    col++;
+  }
+}
+
+static void print_json_str(FILE *out, char *s) {
+  fputc('"', out);
+  for (char *p = s; *p; p++) {
+    if (*p == '"' || *p == '\\')
+      fprintf(out, "\\%c", *p);
+    else if ((unsigned char)*p < 0x20)
+      fprintf(out, "\\u%04x", *p);
+    else
+      fputc(*p, out);
+  }
+  fputc('"', out);
+}
+
+// Prints the statistics of a compilation of `input` to `out`, as a
+// table or as one line of JSON.
+void print_stats(FILE *out, char *input, bool json) {
+  charge(true);
+  double total_wall = now(CLOCK_MONOTONIC) - start_wall;
+  double total_cpu = now(CLOCK_PROCESS_CPUTIME_ID) - start_cpu;
+
+  // add_type()'s CPU time has been charged to the phase that called
+  // it, i.e. parse. Split it in proportion to their wall times.
+  double parse_wall = wall[PH_PARSE] + wall[PH_ADD_TYPE];
+  if (parse_wall > 0) {
+    cpu[PH_ADD_TYPE] = cpu[PH_PARSE] * wall[PH_ADD_TYPE] / parse_wall;
+    cpu[PH_PARSE] -= cpu[PH_ADD_TYPE];
+  }
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+
+  struct {
+    char *name;
+    long val;
+  } counts[] = {
+    {"tokens", stats.tokens},
+    {"nodes", stats.nodes},
+    {"types", stats.types},
+    {"objects", stats.objs},
+    {"find_var_calls", stats.find_var_calls},
+    {"find_var_probes", stats.find_var_probes},
+    {"instructions", stats.insns},
+    {"lines", stats.lines},
+  };
+  int ncounts = sizeof(counts) / sizeof(*counts);
+
+  if (json) {
+    fprintf(out, "{\"file\": ");
+    print_json_str(out, input);
+    fprintf(out, ", \"phases\": {");
+    for (int i = 0; i < NR_PHASES; i++)
+      fprintf(out, "%s\"%s\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f}",
+              i ? ", " : "", phase_names[i], wall[i] * 1e3, cpu[i] * 1e3);
+    fprintf(out, "}, \"total\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f}",
+            total_wall * 1e3, total_cpu * 1e3);
+    for (int i = 0; i < ncounts; i++)
+      fprintf(out, ", \"%s\": %ld", counts[i].name, counts[i].val);
+    fprintf(out, ", \"peak_rss_kb\": %ld}\n", ru.ru_maxrss);
+    return;
+  }
+
+  fprintf(out, "%s:\n", input);
+  fprintf(out, "  %-16s %10s %10s\n", "phase", "wall ms", "cpu ms");
+  for (int i = 0; i < NR_PHASES; i++)
+    fprintf(out, "  %-16s %10.3f %10.3f\n", phase_names[i], wall[i] * 1e3,
+            cpu[i] * 1e3);
+  fprintf(out, "  %-16s %10.3f %10.3f\n", "total", total_wall * 1e3,
+          total_cpu * 1e3);
+  for (int i = 0; i < ncounts; i++)
+    fprintf(out, "  %-16s %10ld\n", counts[i].name, counts[i].val);
+  fprintf(out, "  %-16s %10ld\n", "peak_rss_kb", ru.ru_maxrss);
+}
+
+//
+// Tracing
+//
+
+// A "complete" event, which has a start and a duration
+typedef struct {
+  char *cat;
+  char *name;
+  double ts;
+  double dur;
+  int tid;
+} TraceEvent;
+
+// Events that haven't been written yet. Events come from the codegen
+// threads too.
+static TraceEvent *events;
+static int nr_events;
+static int events_capacity;
+static pthread_mutex_t events_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *trace_path;
+
+// Returns the current time for trace_event(), in microseconds.
+double trace_now(void) {
+  return now(CLOCK_MONOTONIC) * 1e6;
+}
+
+// Records an event from `start` to now. `name` must stay valid until
+// the next flush_trace().
+void trace_event(char *cat, char *name, double start) {
+  static _Thread_local int tid;
+  if (!tid)
+    tid = syscall(SYS_gettid);
+
+  double end = trace_now();
+
+  pthread_mutex_lock(&events_lock);
+  if (nr_events == events_capacity) {
+    events_capacity = events_capacity ? events_capacity * 2 : 256;
+    events = realloc(events, events_capacity * sizeof(TraceEvent));
+  }
+  events[nr_events++] = (TraceEvent){cat, name, start, end - start, tid};
+  pthread_mutex_unlock(&events_lock);
+}
+
+// Starts a new trace file. The file is a JSON array whose closing ']'
+// is never written, which the trace viewers accept, so that several
+// processes can append events to it.
+void start_trace(char *path) {
+  FILE *fp = fopen(path, "w");
+  if (!fp)
+    error("cannot open trace file: %s: %s", path, strerror(errno));
+  fprintf(fp, "[\n");
+  fclose(fp);
+
+  trace_path = path;
+  trace_enabled = true;
+  nr_events = 0;
+}
+
+// Appends the events recorded so far to the trace file.
+void flush_trace(void) {
+  if (!trace_enabled || nr_events == 0)
+    return;
+
+  char *buf;
+  size_t len;
+  FILE *out = open_memstream(&buf, &len);
+  int pid = getpid();
+
+  for (int i = 0; i < nr_events; i++) {
+    TraceEvent *e = &events[i];
+    fprintf(out, "{\"name\": ");
+    print_json_str(out, e->name);
+    fprintf(out, ", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, "
+            "\"dur\": %.3f, \"pid\": %d, \"tid\": %d},\n",
+            e->cat, e->ts, e->dur, pid, e->tid);
+  }
+  fclose(out);
+  nr_events = 0;
+
+  // Worker processes append to the same file, so write each batch
+  // at once and under a lock.
+  FILE *fp = fopen(trace_path, "a");
+  if (!fp)
+    error("cannot open trace file: %s: %s", trace_path, strerror(errno));
+  flock(fileno(fp), LOCK_EX);
+  fwrite(buf, 1, len, fp);
+  fflush(fp);
+  flock(fileno(fp), LOCK_UN);
+  fclose(fp);
+  free(buf);
+}
@@ -1,5 +1,21 @@
 #include "chibicc.h"
 
+void strarray_push(StringArray *arr, char *s) {
+  if (!arr->data) {
+    arr->data = calloc(8, sizeof(char *));
+    arr->capacity = 8;
+  }
+
+  if (arr->capacity == arr->len) {
+    arr->data = realloc(arr->data, sizeof(char *) * arr->capacity * 2);
+    arr->capacity *= 2;
+    for (int i = arr->len; i < arr->capacity; i++)
+      arr->data[i] = NULL;
+  }
+
+  arr->data[arr->len++] = s;
+}
+
 // Takes a printf-style format string and returns a formatted string.
 char *format(char *fmt, ...) {
   char *buf;
@@ -13,3 +29,76 @@ char *format(char *fmt, ...) {
   fclose(out);
   return buf;
 }
+
+//
+// Identifier interning
+//
+// Every identifier spelling is stored only once. intern() returns the
+// same pointer for the same sequence of characters, so two interned
+// names can be compared by pointer instead of by contents.
+//
+
+typedef struct {
+  char *name;
+  int len;
+  uint32_t hash;
+} Atom;
+
+static Atom *atoms;
+static int atoms_capacity;
+static int atoms_used;
+
+// FNV-1a hash
+static uint32_t hash_string(char *p, int len) {
+  uint32_t hash = 2166136261;
+  for (int i = 0; i < len; i++)
+    hash = (hash ^ (unsigned char)p[i]) * 16777619;
+  return hash;
+}
+
+static void rehash_atoms(void) {
+  Atom *old = atoms;
+  int old_capacity = atoms_capacity;
+
+  atoms_capacity = old_capacity ? old_capacity * 2 : 1024;
+  atoms = calloc(atoms_capacity, sizeof(Atom));
+
+  for (int i = 0; i < old_capacity; i++) {
+    if (!old[i].name)
+      continue;
+    int j = old[i].hash & (atoms_capacity - 1);
+    while (atoms[j].name)
+      j = (j + 1) & (atoms_capacity - 1);
+    atoms[j] = old[i];
+  }
+  free(old);
+}
+
+char *intern(char *p, int len) {
+  // Keep the load factor under 50%.
+  if (atoms_used * 2 >= atoms_capacity)
+    rehash_atoms();
+
+  uint32_t hash = hash_string(p, len);
+  int i = hash & (atoms_capacity - 1);
+
+  for (; atoms[i].name; i = (i + 1) & (atoms_capacity - 1)) {
+    Atom *a = &atoms[i];
+    if (a->hash == hash && a->len == len && !memcmp(a->name, p, len))
+      return a->name;
+  }
+
+  atoms[i].name = arena_strndup(&token_arena, p, len);
+  atoms[i].len = len;
+  atoms[i].hash = hash;
+  atoms_used++;
+  return atoms[i].name;
+}
+
+// Forgets all interned names. The names themselves live in
+// token_arena, so this must be called whenever that arena is reset.
+void reset_interner(void) {
+  if (atoms)
+    memset(atoms, 0, atoms_capacity * sizeof(Atom));
+  atoms_used = 0;
+}
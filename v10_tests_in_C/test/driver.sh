@@ -1,6 +1,6 @@
 #!/bin/bash
 tmp=`mktemp -d /tmp/chibicc-test-XXXXXX`
-trap 'rm -rf $tmp' INT TERM HUP EXIT
+trap 'kill $server 2> /dev/null; rm -rf $tmp' INT TERM HUP EXIT
 echo > $tmp/empty.c
 
 check() {
@@ -22,4 +22,258 @@ check -o
 ./chibicc --help 2>&1 | grep -q chibicc
 check --help
 
+# Input without a trailing newline
+printf 'int main() { return 0; }' > $tmp/nonl.c
+./chibicc -o $tmp/out $tmp/nonl.c
+check 'no trailing newline'
+
+# -fmax-errors
+printf 'int main() {\n  x;\n  y;\n  z;\n}\n' > $tmp/errors.c
+./chibicc -fmax-errors=0 -o $tmp/out $tmp/errors.c 2>&1 | grep -c 'undefined variable' | grep -q 3
+check '-fmax-errors=0'
+./chibicc -fmax-errors=2 -o $tmp/out $tmp/errors.c 2>&1 | grep -c 'undefined variable' | grep -q 2
+check '-fmax-errors=2'
+./chibicc -o $tmp/out $tmp/errors.c 2>&1 | grep -c 'undefined variable' | grep -q 1
+check 'single error'
+
+# --type-stats
+printf 'int main() { int x=1; int *p=&x; return *p+x*2-(p-p); }' > $tmp/types.c
+./chibicc --type-stats -o $tmp/out $tmp/types.c 2>&1 |
+  awk '/expression nodes/ { n=$3 } /add_type visits/ { v=$3 } END { exit !(n > 0 && n == v) }'
+check --type-stats
+
+# --stats
+./chibicc --stats -o $tmp/stats.s test/control.c 2> $tmp/stats.txt &&
+  grep -q '^  parse ' $tmp/stats.txt && grep -q '^  peak_rss_kb ' $tmp/stats.txt &&
+  grep -q "^  instructions *$(grep -c '^  [^.]' $tmp/stats.s)\$" $tmp/stats.txt &&
+  grep -q "^  lines *$(wc -l < $tmp/stats.s)\$" $tmp/stats.txt
+check --stats
+./chibicc --stats=json -c -o $tmp/out test/control.c 2>&1 |
+  grep -q '^{"file": "test/control.c", "phases": {"read_file": {"wall_ms": .*"assemble".*"find_var_probes": [1-9][0-9]*, .*}$'
+check --stats=json
+
+# --trace
+./chibicc --trace=$tmp/trace.json -j 2 -o $tmp/out test/control.c &&
+  [ "$(head -1 $tmp/trace.json)" = '[' ] &&
+  grep -q '^{"name": "main", "cat": "parse", "ph": "X", "ts": [0-9.]*, "dur": [0-9.]*, "pid": [0-9]*, "tid": [0-9]*},$' $tmp/trace.json &&
+  grep -q '"name": "main", "cat": "codegen"' $tmp/trace.json &&
+  grep -q '"name": "tokenize", "cat": "phase"' $tmp/trace.json &&
+  grep -q '"name": "test/control.c", "cat": "compile"' $tmp/trace.json
+check --trace
+
+./chibicc --stats --trace=$tmp/trace.json -o $tmp/out test/control.c > /dev/null &&
+  grep -q '"name": "parse", "cat": "phase"' $tmp/trace.json &&
+  ! grep -q '"name": "add_type"' $tmp/trace.json
+check '--stats with --trace'
+
+# -j
+./chibicc -o $tmp/serial.s test/control.c
+./chibicc -j 4 -o $tmp/parallel.s test/control.c
+cmp -s $tmp/serial.s $tmp/parallel.s
+check -j
+
+# -c and assembly output
+./chibicc -c -o $tmp/control.o test/control.c
+cc -o $tmp/control-obj $tmp/control.o -xc test/common &&
+  $tmp/control-obj > /dev/null
+check -c
+cc -o $tmp/control-asm $tmp/serial.s -xc test/common &&
+  $tmp/control-asm > /dev/null
+check 'assembly output'
+
+# Preprocessor
+mkdir -p $tmp/inc
+printf '#define FOO 3\n' > $tmp/inc/foo.h
+printf '#include <foo.h>\nFOO BAR\n' > $tmp/pp.c
+./chibicc -I$tmp/inc -DBAR=4 -E $tmp/pp.c | grep -q '^3 4$'
+check '-I and -D'
+./chibicc -I $tmp/inc -D BAR -E $tmp/pp.c | grep -q '^3 1$'
+check '-I and -D with a space'
+
+printf '#include "guard.h"\n#include "guard.h"\nx\n' > $tmp/guard.c
+printf '#ifndef GUARD\n#define GUARD\ny\n#endif\n' > $tmp/guard.h
+./chibicc -E $tmp/guard.c | tr '\n' ' ' | grep -q '^y x $'
+check 'include guard'
+
+printf '#include "missing.h"\n' > $tmp/missing.c
+./chibicc -E $tmp/missing.c 2>&1 | grep -q "'missing.h' file not found"
+check 'missing include'
+
+printf '#if 1\nx\n' > $tmp/unterminated.c
+./chibicc -E $tmp/unterminated.c 2>&1 | grep -q 'unterminated conditional directive'
+check 'unterminated #if'
+
+# Multiple files
+chibicc=$PWD/chibicc
+printf 'int ret3() { return 3; }\n' > $tmp/a.c
+printf 'int main() { return ret3(); }\n' > $tmp/b.c
+(cd $tmp && $chibicc -c a.c b.c) &&
+  cc -o $tmp/ab $tmp/a.o $tmp/b.o && { $tmp/ab; [ $? = 3 ]; }
+check 'multiple files'
+
+rm -f $tmp/a.o $tmp/b.o
+printf 'a.c "b.c"\n' > $tmp/args
+(cd $tmp && $chibicc -c @args) && [ -f $tmp/a.o ] && [ -f $tmp/b.o ]
+check '@file'
+
+rm -f $tmp/a.o $tmp/b.o
+printf 'int main( {\n' > $tmp/bad.c
+(cd $tmp && $chibicc -c -j 2 a.c bad.c b.c 2> /dev/null)
+[ $? = 1 ] && [ -f $tmp/a.o ] && [ -f $tmp/b.o ]
+check 'error in one of multiple files'
+
+./chibicc -o $tmp/x $tmp/a.c $tmp/b.c 2>&1 | grep -q "cannot specify '-o' with multiple files"
+check '-o with multiple files'
+
+(cd $tmp && $chibicc --trace=trace.json -c a.c b.c -j 2) &&
+  [ $(grep -c '"cat": "compile"' $tmp/trace.json) = 2 ]
+check '--trace with multiple files'
+
+# --incremental
+printf 'int g;\nint f() { return g + 1; }\nint h() { char *s = "x"; return s[0]; }\n' > $tmp/incr.c
+./chibicc --incremental -o $tmp/incr.s $tmp/incr.c &&
+  ./chibicc --incremental -o $tmp/incr.s $tmp/incr.c &&
+  ./chibicc -o $tmp/full.s $tmp/incr.c &&
+  cmp -s $tmp/incr.s $tmp/full.s && [ -f $tmp/incr.s.fn ]
+check '--incremental'
+
+printf 'char g;\nint f() { return g + 1; }\nint h() { char *s = "y"; return s[0]; }\n' > $tmp/incr.c
+./chibicc --incremental -o $tmp/incr.s $tmp/incr.c &&
+  ./chibicc -o $tmp/full.s $tmp/incr.c &&
+  cmp -s $tmp/incr.s $tmp/full.s
+check '--incremental with changed globals'
+
+printf 'int g; int main() { return sizeof(g); }\n' > $tmp/sizeof.c
+./chibicc --incremental -o $tmp/sizeof.s $tmp/sizeof.c &&
+  printf 'char g[3]; int main() { return sizeof(g); }\n' > $tmp/sizeof.c &&
+  ./chibicc --incremental -o $tmp/sizeof.s $tmp/sizeof.c &&
+  ./chibicc -o $tmp/full.s $tmp/sizeof.c &&
+  cmp -s $tmp/sizeof.s $tmp/full.s &&
+  cc -o $tmp/sizeof $tmp/sizeof.s && { $tmp/sizeof; [ $? = 3 ]; }
+check '--incremental with sizeof of a changed global'
+
+# Compile cache
+cache=$tmp/cache
+printf '#define RET 3\n' > $tmp/ret.h
+printf '#include "ret.h"\nint main() { return RET; }\n' > $tmp/cached.c
+./chibicc --cache-dir=$cache -c -o $tmp/cached1.o $tmp/cached.c &&
+  ./chibicc --cache-dir=$cache -c -o $tmp/cached2.o $tmp/cached.c &&
+  cmp -s $tmp/cached1.o $tmp/cached2.o &&
+  ./chibicc --cache-dir=$cache --cache-stats | grep -q '^hits: 1$'
+check '--cache-dir'
+
+printf '#define RET 4\n' > $tmp/ret.h
+./chibicc --cache-dir=$cache -c -o $tmp/cached3.o $tmp/cached.c &&
+  cc -o $tmp/cached $tmp/cached3.o && { $tmp/cached; [ $? = 4 ]; }
+check '--cache-dir with a changed header'
+
+./chibicc --cache-dir=$cache --cache-stats | grep -q '^misses: 2$'
+check '--cache-stats'
+
+./chibicc --cache-dir=$cache --cache-size=1K -c -o $tmp/a.o $tmp/a.c &&
+  [ $(find $cache -mindepth 2 -type f | wc -l) = 1 ]
+check '--cache-size'
+
+# Precompiled headers
+printf '#define N (2)\n#define F(x) ((x) + 1)\nint g;\nchar buf[10];\n' > $tmp/pch.h
+printf '#include "pch.h"\nint main() { g = N; buf[1] = 4; return F(g) + buf[1]; }\n' > $tmp/pch.c
+./chibicc -o $tmp/nopch.s $tmp/pch.c &&
+  ./chibicc --emit-pch $tmp/pch.h && [ -f $tmp/pch.h.pch ] &&
+  ./chibicc -o $tmp/pch.s $tmp/pch.c &&
+  cmp -s $tmp/nopch.s $tmp/pch.s &&
+  cc -o $tmp/pch $tmp/pch.s && { $tmp/pch; [ $? = 7 ]; }
+check --emit-pch
+
+# A header replaced without changing its size or mtime isn't read.
+cp -p $tmp/pch.h $tmp/pch.h.orig
+{ printf '#error x'; head -c $(($(wc -c < $tmp/pch.h.orig) - 9)) /dev/zero | tr '\0' ' '; echo; } > $tmp/pch.h
+touch -r $tmp/pch.h.orig $tmp/pch.h
+./chibicc -o $tmp/pch.s $tmp/pch.c
+check 'precompiled header is used'
+
+printf '#define N (3)\n#define F(x) ((x) + 1)\nint g;\nchar buf[10];\n' > $tmp/pch.h
+./chibicc -o $tmp/pch.s $tmp/pch.c &&
+  cc -o $tmp/pch $tmp/pch.s && { $tmp/pch; [ $? = 8 ]; }
+check 'stale precompiled header'
+
+# Compile server
+./chibicc --server $tmp/sock > /dev/null 2>&1 &
+server=$!
+for i in $(seq 50); do [ -S $tmp/sock ] && break; sleep 0.1; done
+
+./chibicc --client $tmp/sock -o $tmp/client.s test/control.c
+cmp -s $tmp/serial.s $tmp/client.s
+check '--client'
+
+(cd $tmp && $chibicc --client sock -c bad.c 2> $tmp/client.err)
+[ $? = 1 ] && grep -q "expected 'int'" $tmp/client.err
+check '--client with an error'
+
+rm -f $tmp/a.o $tmp/b.o
+(cd $tmp && $chibicc --client sock -c a.c b.c) && [ -f $tmp/a.o ] && [ -f $tmp/b.o ]
+check '--client after an error'
+
+# An error in codegen must not leak the output file.
+printf 'int main() { 1 = 2; return 0; }\n' > $tmp/lvalue.c
+fds=$(ls /proc/$server/fd | wc -l)
+for i in $(seq 30); do
+  ./chibicc --client $tmp/sock -o $tmp/lvalue.s $tmp/lvalue.c 2> /dev/null
+done
+[ $(ls /proc/$server/fd | wc -l) = $fds ] && [ ! -f $tmp/lvalue.s ]
+check '--client with codegen errors'
+
+# Codegen errors on worker threads end the request, not the thread.
+printf 'int f() { return 1; }\nint g() { return 2; }\nint main() { return &1; }\n' > $tmp/addr.c
+tasks=$(ls /proc/$server/task | wc -l)
+ok=1
+for i in $(seq 3); do
+  ./chibicc --client $tmp/sock -j 4 -o $tmp/addr.s $tmp/addr.c 2> $tmp/client.err
+  [ $? = 1 ] && grep -q 'not an lvalue' $tmp/client.err || ok=0
+done
+[ $ok = 1 ] && [ $(ls /proc/$server/task | wc -l) = $tasks ] && [ ! -f $tmp/addr.s ] &&
+  ./chibicc --client $tmp/sock -j 4 -o $tmp/client.s test/control.c &&
+  cmp -s $tmp/serial.s $tmp/client.s
+check '--client -j 4 with codegen errors'
+
+# Descriptors of a malformed request must be closed.
+cat > $tmp/badclient.c <<'EOF2'
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+int main(int argc, char **argv) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  strcpy(addr.sun_path, argv[1]);
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)))
+    return 1;
+
+  int len = 1;
+  char buf[CMSG_SPACE(2 * sizeof(int))] = {0};
+  struct iovec iov = {&len, sizeof(len)};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                       .msg_control = buf, .msg_controllen = sizeof(buf)};
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), (int[]){0, 1}, 2 * sizeof(int));
+  if (sendmsg(sock, &msg, 0) != sizeof(len) || read(sock, &len, sizeof(len)) != sizeof(len))
+    return 1;
+  return len;
+}
+EOF2
+cc -o $tmp/badclient $tmp/badclient.c
+fds=$(ls /proc/$server/fd | wc -l)
+ok=1
+for i in $(seq 30); do
+  $tmp/badclient $tmp/sock
+  [ $? = 1 ] || ok=0
+done
+[ $ok = 1 ] && [ $(ls /proc/$server/fd | wc -l) = $fds ]
+check '--server with a malformed request'
+
+kill $server
+
 echo OK
@@ -0,0 +1,124 @@
+#include "test.h"
+#include "include1.h"
+#include "include1.h"
+
+int ret3() { return 3; }
+int dbl(int x) { return x*x; }
+int sub(int x, int y) { return x-y; }
+
+int main() {
+  ASSERT(5, INCLUDE1);
+  ASSERT(0, include1_count);
+
+#define M1 3
+  ASSERT(3, M1);
+#define M2 M1+1
+  ASSERT(4, M2);
+  ASSERT(5, M2*2);
+
+#undef M1
+  ASSERT(0, ({ int M1=0; M1; }));
+#define M1 5
+  ASSERT(6, M2);
+
+#define M3 M4
+#define M4 M3
+  ASSERT(8, ({ int M3=8; M3; }));
+
+#define ADD(x, y) x+y
+  ASSERT(7, ADD(3, 4));
+  ASSERT(11, ADD(3, 4)*2);
+  ASSERT(13, ADD(ADD(1, 2), ret3()*3+1));
+  ASSERT(4, ({ int ADD=4; ADD; }));
+
+#define PAREN(x) (x)
+  ASSERT(9, PAREN(sub(10, 1)));
+  ASSERT(3, PAREN(ret3()));
+
+#define EMPTY()
+  ASSERT(1, EMPTY() 1);
+
+#define CALL(f, x) f(x)
+  ASSERT(16, CALL(dbl, 4));
+#define DBL dbl
+  ASSERT(9, DBL(3));
+
+#define STR(x) #x
+  ASSERT(6, sizeof(STR(a + b)));
+  ASSERT(43, STR(a+b)[1]);
+  ASSERT(34, STR("x")[0]);
+  ASSERT(92, STR("\n")[1]);
+
+#define CAT(x, y) x##y
+  ASSERT(12, CAT(1, 2));
+  ASSERT(3, CAT(re, t3)());
+  ASSERT(5, CAT(, 5));
+  ASSERT(6, CAT(6, ));
+
+#define LONG_MACRO(x) \
+  ((x) * \
+   (x))
+  ASSERT(49, LONG_MACRO(7));
+
+  int m = 0;
+#if 1
+  m = 1;
+#endif
+  ASSERT(1, m);
+
+#if 0
+  m = 2;
+#if 1
+  m = 3;
+#endif
+  this is not C
+#elif 1
+  m = 4;
+#else
+  m = 5;
+#endif
+  ASSERT(4, m);
+
+#if 0
+#elif 0
+#else
+  m = 6;
+#endif
+  ASSERT(6, m);
+
+#if 1 + 2 * 3 == 7 && (1 << 4) == 16 && !(5 % 3 != 2) && (0 || -1 < 0)
+  m = 7;
+#endif
+  ASSERT(7, m);
+
+#if 1 ? 0 : 1
+  m = 8;
+#endif
+  ASSERT(7, m);
+
+#if defined(M1) && defined M2 && !defined(NOT_DEFINED) && UNDEFINED_NAME == 0
+  m = 9;
+#endif
+  ASSERT(9, m);
+
+#if M1 == 5
+  m = 10;
+#endif
+  ASSERT(10, m);
+
+#ifdef M1
+  m = 11;
+#else
+  m = 12;
+#endif
+  ASSERT(11, m);
+
+#ifndef M1
+  m = 13;
+#endif
+  ASSERT(11, m);
+
+#
+  printf("OK\n");
+  return 0;
+}
@@ -46,6 +46,8 @@ int main() {
   ASSERT(2, ({ int x=2; { int x=3; } x; }));
   ASSERT(2, ({ int x=2; { int x=3; } int y=4; x; }));
   ASSERT(3, ({ int x=2; { x=3; } x; }));
+  ASSERT(2, ({ int x=2; { int x=3; { int x=4; } } x; }));
+  ASSERT(5, ({ int x=2; { int x=3; { int x=4; } x=5; } x+3; }));
 
   printf("OK\n");
   return 0;
@@ -1,53 +1,110 @@
+// MAP_ANONYMOUS is not part of POSIX.
+#define _DEFAULT_SOURCE
 #include "chibicc.h"
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /*
  * we additionally handle block and line comments in the tokenizer
  * along with the previous tasks
  *
- * current_filename points to the current file being tokenized
- * which is initialised to the path of the input file obtained by
- * parsing the argument list given to chibicc
+ * current_file points to the file being tokenized, which is the
+ * input file given to chibicc or a file it #includes
  *
- * current_input points to the input string which is iniitalised to 
- * the in memory buffer allocated by read_file()
+ * current_input points to the input string of current_file, which
+ * is the in memory buffer allocated by read_file()
  */
-// Input filename
-static char *current_filename;
+// Input file
+static File *current_file;
 
 // Input string
 static char *current_input;
 
+// All files read so far, indexed by File::file_no
+static File **input_files;
+static int nr_input_files;
+
+// Output of the tokenizer
+static Token *tokens;
+static int nr_tokens;
+static int tokens_capacity;
+
+// String literal contents, indexed by Token::val
+static StrLit *strs;
+static int nr_strs;
+static int strs_capacity;
+
+// Line table of current_file
+static uint32_t *line_starts;
+static int nr_lines;
+
+// Line of the most recently created token
+static int cur_line;
+
+// Error recovery state, see chibicc.h.
+int max_errors = 1;
+int nr_errors;
+jmp_buf *error_recover;
+Token *error_token;
+_Thread_local jmp_buf *exit_recover;
+
+// Where the tokenizer resumes after an error. If NULL, it resumes at
+// the beginning of the line following the error.
+static char *resume_loc;
+static char *error_loc;
+
+// Ends the compilation with a given exit status.
+void exit_compiler(int status) {
+  if (exit_recover)
+    longjmp(*exit_recover, status + 1);
+  exit(status);
+}
+
 // Reports an error and exit.
-void error(char *fmt, ...) {
+_Noreturn void error(char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
   vfprintf(stderr, fmt, ap);
   fprintf(stderr, "\n");
-  exit(1);
+  exit_compiler(1);
+}
+
+// Returns the line number of a given location by binary search
+// in the line table.
+static int find_line_no(char *loc) {
+  uint32_t pos = loc - current_input;
+  int lo = 0, hi = nr_lines;
+
+  while (hi - lo > 1) {
+    int mid = (lo + hi) / 2;
+    if (line_starts[mid] <= pos)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo + 1;
 }
 
-// Reports an error message in the following format and exit.
+// Reports an error message in the following format.
 //
 // foo.c:10: x = y + 1;
 //               ^ <error message here>
-static void verror_at(char *loc, char *fmt, va_list ap) {
-  // Find a line containing `loc`.
-  char *line = loc;
-  while (current_input < line && line[-1] != '\n')
-    line--;
-
+//
+// Then, if the parser or the tokenizer has set up a recovery point
+// and the -fmax-errors limit hasn't been reached, resumes there.
+// Otherwise exits.
+static void verror_at(File *file, int line_no, char *loc, char *fmt,
+                      va_list ap) {
+  char *line = file->contents + file->line_starts[line_no - 1];
   char *end = loc;
-  while (*end != '\n')
+  while (*end && *end != '\n')
     end++;
 
-  // Get a line number.
-  int line_no = 1;
-  for (char *p = current_input; p < line; p++)
-    if (*p == '\n')
-      line_no++;
-
   // Print out the line.
-  int indent = fprintf(stderr, "%s:%d: ", current_filename, line_no);
+  int indent = fprintf(stderr, "%s:%d: ", file->name, line_no);
   fprintf(stderr, "%.*s\n", (int)(end - line), line);
 
   // Show the error message.
@@ -57,51 +114,278 @@ static void verror_at(char *loc, char *fmt, va_list ap) {
   fprintf(stderr, "^ ");
   vfprintf(stderr, fmt, ap);
   fprintf(stderr, "\n");
-  exit(1);
+
+  nr_errors++;
+  if (error_recover && (max_errors == 0 || nr_errors < max_errors))
+    longjmp(*error_recover, 1);
+
+  if (max_errors != 1)
+    fprintf(stderr, "compilation terminated due to -fmax-errors=%d.\n",
+            max_errors);
+  exit_compiler(1);
 }
 
 void error_at(char *loc, char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  verror_at(loc, fmt, ap);
+  error_token = NULL;
+  error_loc = loc;
+  verror_at(current_file, find_line_no(loc), loc, fmt, ap);
 }
 
 void error_tok(Token *tok, char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  verror_at(tok->loc, fmt, ap);
+  error_token = tok;
+  verror_at(get_file(tok), tok->line_no, token_text(tok), fmt, ap);
+}
+
+File **get_input_files(int *len) {
+  *len = nr_input_files;
+  return input_files;
+}
+
+File *get_file(Token *tok) {
+  return input_files[tok->file_no];
+}
+
+// Returns the spelling of a token in the source. It is not
+// '\0'-terminated; the length is tok->len.
+char *token_text(Token *tok) {
+  return input_files[tok->file_no]->contents + tok->pos;
 }
 
 // Consumes the current token if it matches `op`.
 bool equal(Token *tok, char *op) {
-  return memcmp(tok->loc, op, tok->len) == 0 && op[tok->len] == '\0';
+  return memcmp(token_text(tok), op, tok->len) == 0 && op[tok->len] == '\0';
 }
 
 // Ensure that the current token is `op`.
 Token *skip(Token *tok, char *op) {
   if (!equal(tok, op))
     error_tok(tok, "expected '%s'", op);
-  return tok->next;
+  return tok + 1;
 }
 
 bool consume(Token **rest, Token *tok, char *str) {
   if (equal(tok, str)) {
-    *rest = tok->next;
+    *rest = tok + 1;
     return true;
   }
   *rest = tok;
   return false;
 }
 
-// Create a new token.
+StrLit *str_literal(Token *tok) {
+  assert(tok->kind == TK_STR);
+  return &strs[tok->val];
+}
+
+// Create a new token at the end of the token array. The returned
+// pointer is valid only until the next call of this function.
 static Token *new_token(TokenKind kind, char *start, char *end) {
-  Token *tok = calloc(1, sizeof(Token));
+  if (nr_tokens == tokens_capacity) {
+    int n = tokens_capacity * 2;
+    Token *arr = arena_alloc(&token_arena, n * sizeof(Token));
+    memcpy(arr, tokens, nr_tokens * sizeof(Token));
+    tokens = arr;
+    tokens_capacity = n;
+  }
+
+  Token *tok = &tokens[nr_tokens++];
   tok->kind = kind;
-  tok->loc = start;
+  tok->pos = start - current_input;
   tok->len = end - start;
+  tok->file_no = current_file->file_no;
+
+  // Tokens are created in order, so the line containing this token
+  // is the previous token's line or one after it.
+  while (cur_line + 1 < nr_lines && line_starts[cur_line + 1] <= tok->pos)
+    cur_line++;
+  tok->line_no = cur_line + 1;
+  tok->col = tok->pos - line_starts[cur_line] + 1;
+
+  if (nr_tokens == 1) {
+    tok->at_bol = true;
+    tok->has_space = (tok->pos > 0);
+    return tok;
+  }
+
+  // Anything between two tokens is whitespace or comments. A token is
+  // at the beginning of a line if a newline other than a line
+  // continuation separates it from the previous token.
+  Token *prev = tok - 1;
+  uint32_t prev_end = prev->pos + prev->len;
+  tok->has_space = (tok->pos > prev_end);
+
+  if (tok->line_no != prev->line_no) {
+    char *p = current_input + prev_end;
+    char *q = current_input + tok->pos;
+    while ((p = memchr(p, '\n', q - p))) {
+      if (p[-1] != '\\') {
+        tok->at_bol = true;
+        break;
+      }
+      p++;
+    }
+  }
   return tok;
 }
 
+//
+// Scanning kernels
+//
+// Most of the input bytes are whitespace, comments and string literal
+// bodies. Instead of looking at them one byte at a time, the functions
+// below examine 16 (SSE2) or 32 (AVX2) bytes at once. The best
+// implementation for the running CPU is picked on first use.
+//
+// The vector loops only use aligned loads. An aligned load never
+// crosses a page boundary, so reading a few bytes past the terminating
+// '\0' of the input can't fault even if the buffer ends right there.
+//
+
+// Returns true if c is one of " \t\n\v\f\r", like isspace() in
+// the C locale.
+static bool is_space(char c) {
+  return c == ' ' || ('\t' <= c && c <= '\r');
+}
+
+static char *skip_space_scalar(char *p) {
+  while (is_space(*p))
+    p++;
+  return p;
+}
+
+// Returns a pointer to the first occurrence of any of a, b, c or d.
+// The input is '\0'-terminated, so callers always include '\0'.
+static char *find_any_scalar(char *p, char a, char b, char c, char d) {
+  while (*p != a && *p != b && *p != c && *p != d)
+    p++;
+  return p;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+// Returns a mask of non-whitespace bytes.
+static unsigned nonspace_mask16(__m128i v) {
+  __m128i sp = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+  __m128i t = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+  __m128i ctl = _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(4)), t);
+  return ~_mm_movemask_epi8(_mm_or_si128(sp, ctl)) & 0xffff;
+}
+
+static char *skip_space_sse2(char *p) {
+  uintptr_t off = (uintptr_t)p & 15;
+  char *q = p - off;
+  unsigned mask = nonspace_mask16(_mm_load_si128((__m128i *)q)) >> off << off;
+
+  while (!mask) {
+    q += 16;
+    mask = nonspace_mask16(_mm_load_si128((__m128i *)q));
+  }
+  return q + __builtin_ctz(mask);
+}
+
+static unsigned any_mask16(__m128i v, char a, char b, char c, char d) {
+  __m128i m = _mm_or_si128(
+    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(a)),
+                 _mm_cmpeq_epi8(v, _mm_set1_epi8(b))),
+    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)),
+                 _mm_cmpeq_epi8(v, _mm_set1_epi8(d))));
+  return _mm_movemask_epi8(m);
+}
+
+static char *find_any_sse2(char *p, char a, char b, char c, char d) {
+  uintptr_t off = (uintptr_t)p & 15;
+  char *q = p - off;
+  unsigned mask = any_mask16(_mm_load_si128((__m128i *)q), a, b, c, d) >> off << off;
+
+  while (!mask) {
+    q += 16;
+    mask = any_mask16(_mm_load_si128((__m128i *)q), a, b, c, d);
+  }
+  return q + __builtin_ctz(mask);
+}
+
+__attribute__((target("avx2")))
+static unsigned nonspace_mask32(__m256i v) {
+  __m256i sp = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+  __m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+  __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(4)), t);
+  return ~(unsigned)_mm256_movemask_epi8(_mm256_or_si256(sp, ctl));
+}
+
+__attribute__((target("avx2")))
+static char *skip_space_avx2(char *p) {
+  uintptr_t off = (uintptr_t)p & 31;
+  char *q = p - off;
+  unsigned mask = nonspace_mask32(_mm256_load_si256((__m256i *)q)) >> off << off;
+
+  while (!mask) {
+    q += 32;
+    mask = nonspace_mask32(_mm256_load_si256((__m256i *)q));
+  }
+  return q + __builtin_ctz(mask);
+}
+
+__attribute__((target("avx2")))
+static unsigned any_mask32(__m256i v, char a, char b, char c, char d) {
+  __m256i m = _mm256_or_si256(
+    _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(a)),
+                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8(b))),
+    _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)),
+                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8(d))));
+  return _mm256_movemask_epi8(m);
+}
+
+__attribute__((target("avx2")))
+static char *find_any_avx2(char *p, char a, char b, char c, char d) {
+  uintptr_t off = (uintptr_t)p & 31;
+  char *q = p - off;
+  unsigned mask = any_mask32(_mm256_load_si256((__m256i *)q), a, b, c, d) >> off << off;
+
+  while (!mask) {
+    q += 32;
+    mask = any_mask32(_mm256_load_si256((__m256i *)q), a, b, c, d);
+  }
+  return q + __builtin_ctz(mask);
+}
+#endif
+
+static char *(*skip_space_fn)(char *p);
+static char *(*find_any_fn)(char *p, char a, char b, char c, char d);
+
+static void init_scanners(void) {
+  skip_space_fn = skip_space_scalar;
+  find_any_fn = find_any_scalar;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    skip_space_fn = skip_space_avx2;
+    find_any_fn = find_any_avx2;
+  } else {
+    // SSE2 is part of the x86-64 baseline.
+    skip_space_fn = skip_space_sse2;
+    find_any_fn = find_any_sse2;
+  }
+#endif
+}
+
+// Skips whitespace characters.
+static char *skip_space(char *p) {
+  // A single space between tokens is by far the most common case.
+  if (!is_space(p[1]))
+    return p + 1;
+  return skip_space_fn(p);
+}
+
+static char *find_any(char *p, char a, char b, char c, char d) {
+  return find_any_fn(p, a, b, c, d);
+}
+
 static bool startswith(char *p, char *q) {
   return strncmp(p, q, strlen(q)) == 0;
 }
@@ -125,23 +409,67 @@ static int from_hex(char c) {
 }
 
 // Read a punctuator token from p and returns its length.
-static int read_punct(char *p) {
-  if (startswith(p, "==") || startswith(p, "!=") ||
-      startswith(p, "<=") || startswith(p, ">="))
-    return 2;
+// Its TokenId is returned via `id`.
+static int read_punct(char *p, int *id) {
+  static struct {
+    char *str;
+    TokenId id;
+  } kw[] = {
+    {"==", PU_EQ}, {"!=", PU_NE}, {"<=", PU_LE}, {">=", PU_GE},
+    {"&&", PU_LOGAND}, {"||", PU_LOGOR}, {"<<", PU_SHL}, {">>", PU_SHR},
+    {"##", PU_HASHHASH},
+  };
+
+  for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++) {
+    if (startswith(p, kw[i].str)) {
+      *id = kw[i].id;
+      return 2;
+    }
+  }
 
+  *id = (unsigned char)*p;
   return ispunct(*p) ? 1 : 0;
 }
 
-static bool is_keyword(Token *tok) {
-  static char *kw[] = {
-    "return", "if", "else", "for", "while", "int", "sizeof", "char",
-  };
+// Keywords are recognized with a perfect hash function computed from
+// the identifier's length and its first, second and last characters.
+//
+// The association values below were found by a search over all 44
+// C11 keywords, so every C11 keyword has a distinct slot in a 64-entry
+// table. Only the keywords we support are put into the table; a new
+// keyword is supported by adding it to the slot kw_hash() gives it.
+static unsigned char kw_asso[256] = {
+  ['A'] = 49, ['B'] = 49, ['C'] = 28, ['G'] = 63, ['I'] = 34, ['N'] = 57,
+  ['S'] = 28, ['T'] = 2, ['_'] = 45, ['a'] = 51, ['b'] = 4, ['c'] = 36,
+  ['d'] = 17, ['e'] = 12, ['f'] = 11, ['g'] = 43, ['h'] = 59, ['i'] = 37,
+  ['k'] = 37, ['l'] = 42, ['m'] = 54, ['n'] = 12, ['o'] = 0, ['r'] = 55,
+  ['s'] = 40, ['t'] = 57, ['u'] = 21, ['v'] = 20, ['w'] = 50, ['x'] = 57,
+  ['y'] = 46,
+};
+
+static struct {
+  char *name;
+  TokenId id;
+} kw_table[64] = {
+  [5] = {"for", KW_FOR},       [6] = {"else", KW_ELSE},
+  [21] = {"return", KW_RETURN}, [26] = {"char", KW_CHAR},
+  [30] = {"sizeof", KW_SIZEOF}, [45] = {"int", KW_INT},
+  [61] = {"if", KW_IF},         [62] = {"while", KW_WHILE},
+};
+
+static int kw_hash(char *p, int len) {
+  unsigned char *s = (unsigned char *)p;
+  return (len + kw_asso[s[0]] + kw_asso[s[1]] + kw_asso[s[len - 1]]) & 63;
+}
 
-  for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
-    if (equal(tok, kw[i]))
-      return true;
-  return false;
+// Returns the TokenId of an identifier of length `len` at `p` if
+// it is a keyword, or 0 otherwise.
+static int keyword_id(char *p, int len) {
+  int h = kw_hash(p, len);
+  char *kw = kw_table[h].name;
+  if (kw && !strncmp(p, kw, len) && kw[len] == '\0')
+    return kw_table[h].id;
+  return 0;
 }
 
 static int read_escaped_char(char **new_pos, char *p) {
@@ -200,79 +528,178 @@ static int read_escaped_char(char **new_pos, char *p) {
 // Find a closing double-quote.
 static char *string_literal_end(char *p) {
   char *start = p;
-  for (; *p != '"'; p++) {
-    if (*p == '\n' || *p == '\0')
-      error_at(start, "unclosed string literal");
-    if (*p == '\\')
-      p++;
+  for (;;) {
+    p = find_any(p, '"', '\\', '\n', '\0');
+    if (*p == '"')
+      return p;
+    if (*p == '\\' && p[1] != '\0') {
+      p += 2;
+      continue;
+    }
+    error_at(start, "unclosed string literal");
   }
-  return p;
 }
 
 static Token *read_string_literal(char *start) {
   char *end = string_literal_end(start + 1);
-  char *buf = calloc(1, end - start);
+  char *buf = arena_alloc(&token_arena, end - start);
   int len = 0;
 
   for (char *p = start + 1; p < end;) {
-    if (*p == '\\')
+    if (*p == '\\') {
       buf[len++] = read_escaped_char(&p, p + 1);
-    else
-      buf[len++] = *p++;
+      continue;
+    }
+
+    // Copy a run of ordinary characters at once.
+    char *q = find_any(p, '\\', '"', '"', '"');
+    if (q > end)
+      q = end;
+    memcpy(buf + len, p, q - p);
+    len += q - p;
+    p = q;
   }
 
+  if (nr_strs == strs_capacity) {
+    int n = strs_capacity ? strs_capacity * 2 : 64;
+    StrLit *arr = arena_alloc(&token_arena, n * sizeof(StrLit));
+    memcpy(arr, strs, nr_strs * sizeof(StrLit));
+    strs = arr;
+    strs_capacity = n;
+  }
+  strs[nr_strs] = (StrLit){buf, len + 1};
+
   Token *tok = new_token(TK_STR, start, end + 1);
-  tok->ty = array_of(ty_char, len + 1);
-  tok->str = buf;
+  tok->val = nr_strs++;
   return tok;
 }
 
-static void convert_keywords(Token *tok) {
-  for (Token *t = tok; t->kind != TK_EOF; t = t->next)
-    if (is_keyword(t))
-      t->kind = TK_KEYWORD;
+// Records the offset at which each line starts.
+static void build_line_table(char *p, size_t len) {
+  int capacity = 64;
+  while (capacity < len / 32)
+    capacity *= 2;
+  line_starts = arena_alloc(&token_arena, capacity * sizeof(uint32_t));
+  line_starts[0] = 0;
+  nr_lines = 1;
+
+  for (char *q = p; (q = memchr(q, '\n', p + len - q)); q++) {
+    if (nr_lines == capacity) {
+      uint32_t *arr = arena_alloc(&token_arena, capacity * 2 * sizeof(uint32_t));
+      memcpy(arr, line_starts, capacity * sizeof(uint32_t));
+      line_starts = arr;
+      capacity *= 2;
+    }
+    line_starts[nr_lines++] = q + 1 - p;
+  }
+}
+
+// Registers a source file. `contents` must end with "\n\0".
+File *new_file(char *name, char *contents) {
+  if ((nr_input_files & (nr_input_files - 1)) == 0) {
+    int n = nr_input_files ? nr_input_files * 2 : 16;
+    File **arr = arena_alloc(&token_arena, n * sizeof(File *));
+    memcpy(arr, input_files, nr_input_files * sizeof(File *));
+    input_files = arr;
+  }
+
+  File *file = arena_alloc(&token_arena, sizeof(File));
+  file->name = name;
+  file->file_no = nr_input_files;
+  file->contents = contents;
+  input_files[nr_input_files++] = file;
+  return file;
 }
 
-// Tokenize a given string and returns new tokens.
+// Tokenize a given file and returns new tokens.
 
-/* p points to the in memory buffer that contains the file contents,
- * put there by read_file()
+/* file->contents points to the in memory buffer that contains the
+ * file contents, put there by read_file()
  */
-static Token *tokenize(char *filename, char *p) {
-  current_filename = filename;
+Token *tokenize(File *file) {
+  phase_begin(PH_TOKENIZE);
+  char *p = file->contents;
+  current_file = file;
   current_input = p;
-  Token head = {};
-  Token *cur = &head;
+
+  if (!skip_space_fn)
+    init_scanners();
+
+  // Offsets are 32-bit.
+  size_t len = strlen(p);
+  if (len > UINT32_MAX)
+    error("%s: file too large", file->name);
+
+  // Most sources have fewer tokens than 1 per 4 bytes, so the
+  // token array rarely needs to be grown.
+  tokens_capacity = len / 4 + 16;
+  tokens = arena_alloc(&token_arena, tokens_capacity * sizeof(Token));
+  nr_tokens = 0;
+  Token *cur;
+
+  build_line_table(p, len);
+  file->line_starts = line_starts;
+  file->nr_lines = nr_lines;
+  cur_line = 0;
+
+  // If multiple errors are allowed, skip a bad token and continue.
+  jmp_buf *outer_recover = error_recover;
+  jmp_buf buf;
+  if (max_errors != 1) {
+    if (setjmp(buf)) {
+      if (resume_loc) {
+        p = resume_loc;
+      } else {
+        p = strchr(error_loc, '\n');
+        p = p ? p + 1 : current_input + len;
+      }
+      resume_loc = NULL;
+    }
+    error_recover = &buf;
+  }
 
   while (*p) {
     // Skip line comments.
     if (startswith(p, "//")) {
-      p += 2;
-      while (*p != '\n')
-        p++;
+      p = find_any(p + 2, '\n', '\n', '\n', '\0');
+      if (*p == '\0')
+        break;
       continue;
     }
 
     // Skip block comments.
     if (startswith(p, "/*")) {
-			// strstr() finds the first occurence of "*/" in the remaining string
-			// following p + 2
-      char *q = strstr(p + 2, "*/");
-      if (!q)
-        error_at(p, "unclosed block comment");
+      // Look for the next '*' and check if it closes the comment.
+      char *q = p + 2;
+      for (;;) {
+        q = find_any(q, '*', '*', '*', '\0');
+        if (*q == '\0') {
+          resume_loc = q;
+          error_at(p, "unclosed block comment");
+        }
+        if (q[1] == '/')
+          break;
+        q++;
+      }
       p = q + 2;
       continue;
     }
 
     // Skip whitespace characters.
-    if (isspace(*p)) {
-      p++;
+    if (is_space(*p)) {
+      p = skip_space(p);
+      continue;
+    }
+
+    // Skip line continuations.
+    if (*p == '\\' && p[1] == '\n') {
+      p += 2;
       continue;
     }
 
     // Numeric literal
     if (isdigit(*p)) {
-      cur = cur->next = new_token(TK_NUM, p, p);
+      cur = new_token(TK_NUM, p, p);
       char *q = p;
       cur->val = strtoul(p, &p, 10);
       cur->len = p - q;
@@ -281,7 +708,7 @@ static Token *tokenize(char *filename, char *p) {
 
     // String literal
     if (*p == '"') {
-      cur = cur->next = read_string_literal(p);
+      cur = read_string_literal(p);
       p += cur->len;
       continue;
     }
@@ -292,75 +719,208 @@ static Token *tokenize(char *filename, char *p) {
       do {
         p++;
       } while (is_ident2(*p));
-      cur = cur->next = new_token(TK_IDENT, start, p);
+      int id = keyword_id(start, p - start);
+      cur = new_token(id ? TK_KEYWORD : TK_IDENT, start, p);
+      cur->id = id;
+      cur->ident = intern(start, p - start);
       continue;
     }
 
     // Punctuators
-    int punct_len = read_punct(p);
+    int id;
+    int punct_len = read_punct(p, &id);
     if (punct_len) {
-      cur = cur->next = new_token(TK_PUNCT, p, p + punct_len);
+      cur = new_token(TK_PUNCT, p, p + punct_len);
+      cur->id = id;
       p += cur->len;
       continue;
     }
 
+    resume_loc = p + 1;
     error_at(p, "invalid token");
   }
 
-  cur = cur->next = new_token(TK_EOF, p, p);
-  convert_keywords(head.next);
-  return head.next;
+  error_recover = outer_recover;
+  new_token(TK_EOF, p, p)->at_bol = true;
+  stats.tokens += nr_tokens;
+  phase_end(PH_TOKENIZE);
+  return tokens;
 }
 
-// Returns the contents of a given file.
-/* opens a memory stream to store the file contents into an in-memory
- * buffer that grows dynamically, and returns a pointer to the start
- * of the buffer, that is used by the tokenizer
- */
-static char *read_file(char *path) {
-  FILE *fp;
-
-	// if the path is "-", then we read from stdin :)
-  if (strcmp(path, "-") == 0) {
-    // By convention, read from stdin if a given filename is "-".
-    fp = stdin;
-  } else {
-    fp = fopen(path, "r");
-    if (!fp)
-      error("cannot open %s: %s", path, strerror(errno));
-  }
+// Returns the number of bytes that can be read from `fd` without
+// blocking, or 0 if unknown.
+static size_t pending_bytes(int fd) {
+  int n;
+  if (ioctl(fd, FIONREAD, &n) == 0 && n > 0)
+    return n;
+  return 0;
+}
 
-  char *buf;
-  size_t buflen;
-  FILE *out = open_memstream(&buf, &buflen);
+// Reads everything from a file descriptor until EOF into a buffer
+// terminated with "\n\0".
+//
+// This is used for stdin and other files that cannot be mapped, most
+// commonly a pipe from `cc -E`. The buffer is sized from the amount of
+// data already waiting in the pipe and grows geometrically, so that a
+// large input is read with few read(2) calls and few reallocations.
+static char *read_fd(int fd) {
+  size_t cap = 64 * 1024;
+  size_t len = 0;
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    cap = st.st_size + 2;
+  else if (pending_bytes(fd) + 2 > cap)
+    cap = pending_bytes(fd) + 2;
+
+  char *buf = malloc(cap);
+  if (!buf)
+    error("out of memory");
 
-  // Read the entire file.
   for (;;) {
-    char buf2[4096];
-    int n = fread(buf2, 1, sizeof(buf2), fp);
+    // Keep room for the terminating "\n\0".
+    if (cap - len < 2 + 4096) {
+      size_t want = len + pending_bytes(fd) + 2;
+      cap = (cap * 2 > want) ? cap * 2 : want;
+      buf = realloc(buf, cap);
+      if (!buf)
+        error("out of memory");
+    }
+
+    ssize_t n = read(fd, buf + len, cap - len - 2);
     if (n == 0)
       break;
-		// write n members of size 1 bytes from buf2 to out, 
-		// i.e. the buffer stream that we have allocated for storing the file
-    fwrite(buf2, 1, n, out);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      error("read failed: %s", strerror(errno));
+    }
+    len += n;
   }
 
-  if (fp != stdin)
-    fclose(fp);
+  // Make sure that the last line is properly terminated with '\n'.
+  if (len == 0 || buf[len - 1] != '\n')
+    buf[len++] = '\n';
+  buf[len] = '\0';
+  return buf;
+}
+
+// Maps a regular file into memory without copying it.
+//
+// The tokenizer needs the input to end with "\n\0". To be able to
+// append those two bytes in place, we first reserve an anonymous
+// zero-filled region that is at least two bytes larger than the
+// file and then map the file over its beginning. The bytes past the
+// end of the file are then either the zero-filled tail of the file's
+// last page or part of the anonymous region. The mapping is private,
+// so writing the sentinel copies at most one page and never touches
+// the file itself.
+//
+// Returns NULL if the file cannot be mapped.
+static char *map_file(int fd, size_t size, size_t *map_len) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t len = (size + 2 + page - 1) / page * page;
+  *map_len = len;
+
+  char *buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED)
+    return NULL;
+
+  if (size > 0 &&
+      mmap(buf, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+           fd, 0) == MAP_FAILED) {
+    munmap(buf, len);
+    return NULL;
+  }
 
   // Make sure that the last line is properly terminated with '\n'.
-  fflush(out);
-  if (buflen == 0 || buf[buflen - 1] != '\n')
-    fputc('\n', out);
-  fputc('\0', out);
+  if (size == 0 || buf[size - 1] != '\n')
+    buf[size++] = '\n';
+  buf[size] = '\0';
+  return buf;
+}
+
+// Returns the contents of a given file, or NULL if it cannot be
+// opened.
+//
+// Regular files are mapped into memory, and the size of the mapping
+// is stored to *map_len. Anything else, such as a pipe or a terminal,
+// is read with read_fd() into a malloc()ed buffer.
+static char *read_file(char *path, size_t *map_len) {
+  *map_len = 0;
+
+	// if the path is "-", then we read from stdin :)
+  if (strcmp(path, "-") == 0) {
+    // By convention, read from stdin if a given filename is "-".
+    return read_fd(STDIN_FILENO);
+  }
 
-	// close the stream that we had opened
-  fclose(out);
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return NULL;
 
-	// printf("read %ld characters into the buffer\n", buflen);
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    char *buf = map_file(fd, st.st_size, map_len);
+    if (buf) {
+      close(fd);
+      return buf;
+    }
+  }
+
+  char *buf = read_fd(fd);
+  close(fd);
   return buf;
 }
 
+// Forgets the files, tokens and errors of the previous compilation.
+// The contents of the files read from disk are released here; the
+// rest lives in token_arena, which is reset along with this.
+void reset_tokenizer(void) {
+  for (int i = 0; i < nr_input_files; i++) {
+    File *file = input_files[i];
+    if (!file->owns_contents)
+      continue;
+    if (file->map_len)
+      munmap(file->contents, file->map_len);
+    else
+      free(file->contents);
+  }
+
+  current_file = NULL;
+  current_input = NULL;
+  input_files = NULL;
+  nr_input_files = 0;
+  tokens = NULL;
+  nr_tokens = tokens_capacity = 0;
+  strs = NULL;
+  nr_strs = strs_capacity = 0;
+
+  nr_errors = 0;
+  error_recover = NULL;
+  error_token = NULL;
+  resume_loc = error_loc = NULL;
+}
+
+// Reads a file and registers it without tokenizing it. Returns NULL
+// if the file cannot be opened; errno tells why.
+File *load_file(char *path) {
+  size_t map_len;
+  phase_begin(PH_READ_FILE);
+  char *p = read_file(path, &map_len);
+  phase_end(PH_READ_FILE);
+  if (!p)
+    return NULL;
+
+  File *file = new_file(path, p);
+  file->owns_contents = true;
+  file->map_len = map_len;
+  return file;
+}
+
+// Returns NULL if the file cannot be opened; errno tells why.
 Token *tokenize_file(char *path) {
-  return tokenize(path, read_file(path));
+  File *file = load_file(path);
+  return file ? tokenize(file) : NULL;
 }
@@ -7,53 +7,100 @@ bool is_integer(Type *ty) {
   return ty->kind == TY_CHAR || ty->kind == TY_INT;
 }
 
-Type *copy_type(Type *ty) {
-  Type *ret = calloc(1, sizeof(Type));
-  *ret = *ty;
-  return ret;
+// Hash table of all types created so far, see the comment at
+// struct Type.
+static Type **types;
+static int types_capacity;
+static int types_used;
+
+static uint32_t hash_type(Type *ty) {
+  uint64_t h = ty->kind;
+  h = h * 31 + (uintptr_t)ty->base;
+  h = h * 31 + ty->array_len;
+  h = h * 31 + (uintptr_t)ty->return_ty;
+  for (int i = 0; i < ty->nparams; i++)
+    h = h * 31 + (uintptr_t)ty->params[i];
+  return (h ^ (h >> 32)) * 0x9E3779B1;
 }
 
-Type *pointer_to(Type *base) {
-  Type *ty = calloc(1, sizeof(Type));
-  ty->kind = TY_PTR;
-  ty->size = 8;
-  ty->base = base;
-  return ty;
+// Component types are canonical, so they can be compared by pointer.
+static bool same_type(Type *a, Type *b) {
+  if (a->kind != b->kind || a->base != b->base ||
+      a->array_len != b->array_len || a->return_ty != b->return_ty ||
+      a->nparams != b->nparams)
+    return false;
+  for (int i = 0; i < a->nparams; i++)
+    if (a->params[i] != b->params[i])
+      return false;
+  return true;
 }
 
-Type *func_type(Type *return_ty) {
-  Type *ty = calloc(1, sizeof(Type));
-  ty->kind = TY_FUNC;
-  ty->return_ty = return_ty;
-  return ty;
+static void rehash_types(void) {
+  Type **old = types;
+  int old_capacity = types_capacity;
+
+  types_capacity = old_capacity ? old_capacity * 2 : 256;
+  types = arena_alloc(&type_arena, types_capacity * sizeof(Type *));
+
+  for (int i = 0; i < old_capacity; i++) {
+    if (!old[i])
+      continue;
+    int j = hash_type(old[i]) & (types_capacity - 1);
+    while (types[j])
+      j = (j + 1) & (types_capacity - 1);
+    types[j] = old[i];
+  }
 }
 
-Type *array_of(Type *base, int len) {
-  Type *ty = calloc(1, sizeof(Type));
-  ty->kind = TY_ARRAY;
-  ty->size = base->size * len;
-  ty->base = base;
-  ty->array_len = len;
+// Returns the canonical type that is structurally identical to `key`,
+// creating it if it doesn't exist yet.
+static Type *intern_type(Type *key) {
+  if (types_used * 2 >= types_capacity)
+    rehash_types();
+
+  int i = hash_type(key) & (types_capacity - 1);
+  for (; types[i]; i = (i + 1) & (types_capacity - 1))
+    if (same_type(types[i], key))
+      return types[i];
+
+  stats.types++;
+  Type *ty = arena_alloc(&type_arena, sizeof(Type));
+  *ty = *key;
+  if (key->nparams) {
+    ty->params = arena_alloc(&type_arena, key->nparams * sizeof(Type *));
+    memcpy(ty->params, key->params, key->nparams * sizeof(Type *));
+  }
+
+  types[i] = ty;
+  types_used++;
   return ty;
 }
 
-void add_type(Node *node) {
-  if (!node || node->ty)
-    return;
+Type *pointer_to(Type *base) {
+  return intern_type(&(Type){.kind = TY_PTR, .size = 8, .base = base});
+}
 
-  add_type(node->lhs);
-  add_type(node->rhs);
-  add_type(node->cond);
-  add_type(node->then);
-  add_type(node->els);
-  add_type(node->init);
-  add_type(node->inc);
+Type *func_type(Type *return_ty, Type **params, int nparams) {
+  return intern_type(&(Type){
+    .kind = TY_FUNC,
+    .return_ty = return_ty,
+    .params = params,
+    .nparams = nparams,
+  });
+}
 
-  for (Node *n = node->body; n; n = n->next)
-    add_type(n);
-  for (Node *n = node->args; n; n = n->next)
-    add_type(n);
+Type *array_of(Type *base, int len) {
+  return intern_type(&(Type){
+    .kind = TY_ARRAY,
+    .size = base->size * len,
+    .base = base,
+    .array_len = len,
+  });
+}
+
+int nr_type_visits;
 
+static void set_type(Node *node) {
   switch (node->kind) {
   case ND_ADD:
   case ND_SUB:
@@ -102,4 +149,25 @@ void add_type(Node *node) {
     error_tok(node->tok, "statement expression returning void is not supported");
     return;
   }
+
+  unreachable();
+}
+
+// Computes the type of an expression node. Nodes are built bottom-up
+// and each builder calls this function as soon as the operands are
+// set, so the operands are always typed already and no tree walk is
+// needed. nr_type_visits counts the calls; it equals nr_expr_nodes
+// if every expression node is typed exactly once.
+void add_type(Node *node) {
+  nr_type_visits++;
+
+  // This is called for every expression node, so the phase is timed
+  // only when stats are wanted.
+  if (stats_enabled) {
+    phase_begin(PH_ADD_TYPE);
+    set_type(node);
+    phase_end(PH_ADD_TYPE);
+    return;
+  }
+  set_type(node);
 }